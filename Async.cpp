@@ -0,0 +1,663 @@
+#include "Async.h"
+
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+
+#define LOOP_MAX_EVENTS 64
+#define CONN_INBUF_SIZE 64*1024     //grows up to maxrecvlen for large frames
+
+EventLoop::EventLoop()
+{
+    struct epoll_event ev;
+
+    m_isstop = false;
+    m_nexttimer = 0;
+    m_epfd = epoll_create1(EPOLL_CLOEXEC);
+    m_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;     //the wake fd is the only one without an IoState
+    epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_wakefd, &ev);
+}
+
+EventLoop::~EventLoop()
+{
+    close(m_wakefd);
+    close(m_epfd);
+}
+
+uint64_t EventLoop::now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+bool EventLoop::isLoopThread()
+{
+    return m_thread.load() == std::this_thread::get_id();
+}
+
+//edge triggered, readiness is kept in the IoState until a waiter consumes it
+int EventLoop::add(int fd, IoState *io)
+{
+    struct epoll_event ev;
+
+    io->reader = io->writer = nullptr;
+    io->readready = io->writeready = false;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = io;
+    return epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void EventLoop::del(int fd, IoState *)
+{
+    epoll_ctl(m_epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+void EventLoop::post(std::coroutine_handle<> h)
+{
+    if (isLoopThread()){
+        m_ready.push_back(h);
+        return;
+    }
+    m_mtx.lock();
+    m_posted.push_back(h);
+    m_mtx.unlock();
+    eventfd_write(m_wakefd, 1);
+}
+
+void EventLoop::spawn(Task<void> task)
+{
+    auto runner = [](EventLoop *loop, Task<void> t) -> async_detail::Detached {
+        co_await loop->schedule();
+        co_await t;
+    };
+    runner(this, std::move(task));
+}
+
+uint64_t EventLoop::callAfter(int ms, std::function<void()> fn)
+{
+    uint64_t id;
+
+    id = ++m_nexttimer;
+    m_timerids[id] = m_timers.emplace(now() + (ms > 0 ? ms : 0), std::make_pair(id, std::move(fn)));
+    return id;
+}
+
+void EventLoop::cancel(uint64_t id)
+{
+    auto it = m_timerids.find(id);
+
+    if (it == m_timerids.end())
+        return;
+    m_timers.erase(it->second);
+    m_timerids.erase(it);
+}
+
+//epoll_wait timeout in ms up to the first timer, -1 if there is none
+int EventLoop::timeout()
+{
+    uint64_t t;
+
+    if (!m_ready.empty())
+        return 0;
+    if (m_timers.empty())
+        return -1;
+    t = now();
+    if (m_timers.begin()->first <= t)
+        return 0;
+    return (int)(m_timers.begin()->first - t);
+}
+
+void EventLoop::runTimers()
+{
+    std::function<void()> fn;
+    uint64_t t;
+
+    t = now();
+    while (!m_timers.empty() && m_timers.begin()->first <= t){
+        fn = std::move(m_timers.begin()->second.second);
+        m_timerids.erase(m_timers.begin()->second.first);
+        m_timers.erase(m_timers.begin());
+        fn();
+    }
+}
+
+void EventLoop::run()
+{
+    struct epoll_event events[LOOP_MAX_EVENTS];
+    std::vector<std::coroutine_handle<>> ready;
+    IoState *io;
+    eventfd_t val;
+    int i, n;
+
+    m_thread = std::this_thread::get_id();
+    while (!m_isstop){
+        n = epoll_wait(m_epfd, events, LOOP_MAX_EVENTS, timeout());
+        if (n < 0 && errno != EINTR){
+            perror("epoll_wait");
+            break;
+        }
+        //mark every fd before resuming anything, a resumed coroutine may free
+        //an IoState that comes later in events
+        for (i=0; i<n; i++){
+            io = (IoState *)events[i].data.ptr;
+            if (io == NULL){
+                eventfd_read(m_wakefd, &val);
+                m_mtx.lock();
+                m_ready.insert(m_ready.end(), m_posted.begin(), m_posted.end());
+                m_posted.clear();
+                m_mtx.unlock();
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)){
+                io->readready = true;
+                if (io->reader)
+                    m_ready.push_back(std::exchange(io->reader, nullptr));
+            }
+            if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)){
+                io->writeready = true;
+                if (io->writer)
+                    m_ready.push_back(std::exchange(io->writer, nullptr));
+            }
+        }
+        runTimers();
+        ready.swap(m_ready);
+        for (auto h : ready)
+            h.resume();
+        ready.clear();
+    }
+    m_thread = std::thread::id();
+}
+
+void EventLoop::stop()
+{
+    m_isstop = true;
+    eventfd_write(m_wakefd, 1);
+}
+
+bool EventLoop::IoAwaiter::await_ready() noexcept
+{
+    bool &ready = forwrite ? io->writeready : io->readready;
+
+    //an edge that came while nobody waited, the caller retries its syscall
+    if (ready){
+        ready = false;
+        return true;
+    }
+    return false;
+}
+
+void EventLoop::IoAwaiter::await_suspend(std::coroutine_handle<> h) noexcept
+{
+    if (forwrite)
+        io->writer = h;
+    else
+        io->reader = h;
+}
+
+EventLoopGroup::EventLoopGroup(int count)
+{
+    int i;
+
+    m_next = 0;
+    for (i=0; i<(count > 0 ? count : 1); i++)
+        m_loops.emplace_back(new EventLoop());
+}
+
+EventLoopGroup::~EventLoopGroup()
+{
+    stop();
+}
+
+void EventLoopGroup::start()
+{
+    if (!m_threads.empty())
+        return;
+    for (auto &loop : m_loops)
+        m_threads.emplace_back([l = loop.get()]{ l->run(); });
+}
+
+void EventLoopGroup::stop()
+{
+    for (auto &loop : m_loops)
+        loop->stop();
+    for (auto &t : m_threads)
+        t.join();
+    m_threads.clear();
+}
+
+EventLoop *EventLoopGroup::get(int i)
+{
+    return m_loops[i].get();
+}
+
+EventLoop *EventLoopGroup::next()
+{
+    return m_loops[m_next++ % m_loops.size()].get();
+}
+
+int EventLoopGroup::size()
+{
+    return m_loops.size();
+}
+
+AsyncConnection::AsyncConnection(EventLoop *loop, int sock, bool isserver, const TRANSPORT_OPTS *opts)
+{
+    m_loop = loop;
+    m_sock = sock;
+    m_isserver = isserver;
+    m_wirever = 1;
+    m_isflushing = false;
+    if (opts)
+        m_nc.set_options(opts);
+    memset(&m_remote, 0, sizeof(m_remote));
+    memcpy(m_sign, BH_SIGN, 8);
+    memcpy(m_key, CRYPT_KEY, 16);
+    m_in.resize(CONN_INBUF_SIZE);
+    m_inused = 0;
+    m_resyncs = 0;
+    m_resyncbytes = 0;
+    m_decoder.reset(new FrameDecoder<TcpTransport>(m_sign, m_key, m_nc.get_options().maxrecvlen,
+                                                   &m_resyncs, &m_resyncbytes));
+    m_outoff = 0;
+    m_hbtimer = 0;
+    m_loop->add(m_sock, &m_io);
+}
+
+AsyncConnection::~AsyncConnection()
+{
+    close();
+}
+
+Task<std::unique_ptr<AsyncConnection>> AsyncConnection::connect(EventLoop *loop, const char *ip, int port,
+                                                                const TRANSPORT_OPTS *opts)
+{
+    std::unique_ptr<AsyncConnection> conn;
+    NetCore nc;
+    struct sockaddr_in rem_addr;
+    struct sockaddr_in peer;
+    uint64_t timer;
+    int sock, ret, error, flags;
+    socklen_t len;
+
+    if (opts)
+        nc.set_options(opts);
+    memset(&rem_addr, 0, sizeof(rem_addr));
+    rem_addr.sin_family = AF_INET;
+    rem_addr.sin_port = htons(port);
+    if (inet_aton(ip, &rem_addr.sin_addr) == 0)
+        co_return nullptr;
+    sock = nc.socket_new(SOCK_STREAM);
+    if (sock < 0)
+        co_return nullptr;
+    if ((flags = fcntl(sock, F_GETFL, 0)) < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0){
+        ::close(sock);
+        co_return nullptr;
+    }
+    conn.reset(new AsyncConnection(loop, sock, false, &nc.get_options()));
+
+    ret = ::connect(sock, (struct sockaddr *)&rem_addr, sizeof(rem_addr));
+    if (ret < 0 && errno != EINPROGRESS){
+        perror("connect");
+        co_return nullptr;
+    }
+    if (ret < 0){
+        //the timer only wakes the wait, a socket still connecting has no peer
+        timer = loop->callAfter(nc.get_options().conntimeout*1000, [c = conn.get()]{ c->kick(); });
+        co_await loop->writable(&conn->m_io);
+        loop->cancel(timer);
+        error = 0;
+        len = sizeof(error);
+        if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error)
+            co_return nullptr;
+        len = sizeof(peer);
+        if (getpeername(sock, (struct sockaddr *)&peer, &len) < 0)
+            co_return nullptr;
+    }
+    strcpy(conn->m_remote.szip, inet_ntoa(rem_addr.sin_addr));
+    conn->m_remote.port = port;
+
+    LinkControl<AsyncConnection>::start(conn.get(), false);
+    if (co_await conn->flush() < 0)
+        co_return nullptr;
+    co_return std::move(conn);
+}
+
+size_t AsyncConnection::pending()
+{
+    return m_out.size() - m_outoff;
+}
+
+//append one frame encoded like DataTransmit does for the negotiated version
+void AsyncConnection::queueframe(int kind, const char *buf, int len)
+{
+    size_t old;
+    int n;
+
+    //drop what the flusher has written once it is the larger part
+    if (m_outoff > 0 && m_outoff * 2 >= m_out.size()){
+        m_out.erase(m_out.begin(), m_out.begin() + m_outoff);
+        m_outoff = 0;
+    }
+    old = m_out.size();
+    m_out.resize(old + len + FRAME_MAX_HEAD);
+    if (kind == FK_DATA)
+        n = TcpTransport::encode(m_out.data() + old, buf, len, m_wirever, m_sign, m_key);
+    else
+        n = TcpTransport::frame(m_out.data() + old, kind, buf, len, m_wirever, m_sign);
+    m_out.resize(old + n);
+}
+
+//queued like data, the next flush writes it, there is no shared memory to switch to
+int AsyncConnection::sendcontrol(int type, const char *data, int len, bool, int newver)
+{
+    char payload[CONTROL_MAX_LEN];
+
+    if (m_sock < 0 || len + 1 > CONTROL_MAX_LEN)
+        return -1;
+    payload[0] = (char)type;
+    if (len > 0)
+        memcpy(payload + 1, data, len);
+    queueframe(FK_CONTROL, payload, len + 1);
+    if (newver)
+        m_wirever = newver;
+    return len + 1;
+}
+
+int AsyncConnection::sendheartbeat()
+{
+    if (m_sock < 0)
+        return -1;
+    queueframe(FK_HEARTBEAT, NULL, 0);
+    return 0;
+}
+
+int AsyncConnection::sendpending()
+{
+    return pending();
+}
+
+void AsyncConnection::setversion(int ver)
+{
+    m_wirever = ver;
+}
+
+//one checked frame from the decoder, data waits in m_inmsgs for recv
+void AsyncConnection::onframe(const FRAME_INFO *fi, char *plain)
+{
+    switch (fi->kind){
+    case FK_DATA:
+        //options are not used here, FO_DEDUP only comes once CT_DEDUP was answered
+        m_inmsgs.emplace_back(plain, plain + fi->len);
+        break;
+    case FK_CONTROL:
+        LinkControl<AsyncConnection>::oncontrol(this, m_isserver, (unsigned char)plain[0], plain + 1, fi->len - 1);
+        break;
+    default:
+        //heart beat or ack
+        break;
+    }
+}
+
+//arm the heart beat on the loop of the connection, an idle link still shows the peer it is alive
+void AsyncConnection::startheartbeat()
+{
+    if (m_hbtimer != 0 || m_sock < 0)
+        return;
+    m_hbtimer = m_loop->callAfter(m_nc.get_options().heartbeatinterval*1000, [this]{ heartbeat(); });
+}
+
+void AsyncConnection::heartbeat()
+{
+    m_hbtimer = 0;
+    if (m_sock < 0)
+        return;
+    LinkControl<AsyncConnection>::heartbeat(this);
+    //a running flusher writes the frame anyway
+    if (!m_isflushing)
+        writeout();
+    startheartbeat();
+}
+
+//write what the socket takes without waiting, the rest goes out with the next flush
+void AsyncConnection::writeout()
+{
+    ssize_t ret;
+
+    while (m_sock >= 0 && m_outoff < m_out.size()){
+        ret = ::send(m_sock, m_out.data() + m_outoff, m_out.size() - m_outoff, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (ret > 0){
+            m_outoff += ret;
+            continue;
+        }
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 && errno == EAGAIN)
+            return;
+        perror("send");
+        close();
+        return;
+    }
+    m_out.clear();
+    m_outoff = 0;
+}
+
+//write the outbound buffer until it is empty, one flusher at a time
+Task<int> AsyncConnection::flush()
+{
+    ssize_t ret;
+
+    m_isflushing = true;
+    while (m_sock >= 0 && m_outoff < m_out.size()){
+        ret = ::send(m_sock, m_out.data() + m_outoff, m_out.size() - m_outoff, MSG_NOSIGNAL);
+        if (ret > 0){
+            m_outoff += ret;
+            if (pending() <= (size_t)m_nc.get_options().lowmark)
+                wakedrain();
+            continue;
+        }
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 && errno == EAGAIN){
+            co_await m_loop->writable(&m_io);
+            continue;
+        }
+        perror("send");
+        close();
+    }
+    m_isflushing = false;
+    m_out.clear();
+    m_outoff = 0;
+    wakedrain();
+    co_return m_sock >= 0 ? 0 : -1;
+}
+
+Task<int> AsyncConnection::send(const char *buf, int len)
+{
+    if (m_sock < 0 || len <= 0 || len > m_nc.get_options().maxdatalen)
+        co_return -1;
+    startheartbeat();
+    queueframe(FK_DATA, buf, len);
+    if (!m_isflushing)
+        co_return co_await flush() < 0 ? -1 : len;
+    //a write is running, it takes this frame too
+    while (m_sock >= 0 && pending() > (size_t)m_nc.get_options().sendlimit)
+        co_await DrainAwaiter{this};
+    co_return m_sock >= 0 ? len : -1;
+}
+
+Task<std::optional<std::vector<char>>> AsyncConnection::recv()
+{
+    std::vector<char> msg;
+    ssize_t ret;
+    int off;
+
+    startheartbeat();
+    while (true){
+        if (!m_inmsgs.empty()){
+            msg = std::move(m_inmsgs.front());
+            m_inmsgs.pop_front();
+            co_return std::move(msg);
+        }
+        if (m_sock < 0)
+            co_return std::nullopt;
+
+        if (m_inused == m_in.size())
+            m_in.resize(std::min(m_in.size() * 2, (size_t)m_nc.get_options().maxrecvlen + FRAME_MAX_HEAD));
+        ret = ::recv(m_sock, m_in.data() + m_inused, m_in.size() - m_inused, 0);
+        if (ret > 0){
+            m_inused += ret;
+            m_nc.rearm_quickack(m_sock);
+            //v1 and v2 frames may be mixed, the rest is the start of a frame
+            off = m_decoder->decode(m_in.data(), m_inused, [this](const FRAME_INFO *fi, char *plain){
+                onframe(fi, plain);
+            });
+            if (off > 0){
+                memmove(m_in.data(), m_in.data() + off, m_inused - off);
+                m_inused -= off;
+            }
+            //answers to control frames
+            if (pending() > 0 && !m_isflushing)
+                co_await flush();
+            continue;
+        }
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 && errno == EAGAIN){
+            co_await m_loop->readable(&m_io);
+            continue;
+        }
+        close();
+        co_return std::nullopt;
+    }
+}
+
+//resume whoever waits on the socket, they see the new state and retry or give up
+void AsyncConnection::kick()
+{
+    if (m_io.reader)
+        m_loop->post(std::exchange(m_io.reader, nullptr));
+    if (m_io.writer)
+        m_loop->post(std::exchange(m_io.writer, nullptr));
+}
+
+void AsyncConnection::wakedrain()
+{
+    for (auto h : m_drainwait)
+        m_loop->post(h);
+    m_drainwait.clear();
+}
+
+void AsyncConnection::close()
+{
+    if (m_sock < 0)
+        return;
+    if (m_hbtimer != 0)
+        m_loop->cancel(m_hbtimer);
+    m_hbtimer = 0;
+    m_loop->del(m_sock, &m_io);
+    ::close(m_sock);
+    m_sock = -1;
+    kick();
+    wakedrain();
+}
+
+bool AsyncConnection::isOpen()
+{
+    return m_sock >= 0;
+}
+
+EventLoop *AsyncConnection::loop()
+{
+    return m_loop;
+}
+
+HOST_INFO AsyncConnection::getRemote()
+{
+    return m_remote;
+}
+
+void AsyncConnection::getResyncStats(unsigned long *events, unsigned long *skipped)
+{
+    *events = m_resyncs;
+    *skipped = m_resyncbytes;
+}
+
+AsyncServer::AsyncServer(EventLoop *loop, int port, const char *ip, const TRANSPORT_OPTS *opts)
+{
+    struct in_addr addr;
+    int flags;
+
+    m_loop = loop;
+    if (opts)
+        m_nc.set_options(opts);
+    if (ip && inet_aton(ip, &addr) == 0){
+        m_sock = -1;
+        return;
+    }
+    m_sock = m_nc.socket_new_listen(SOCK_STREAM, port, ip ? &addr : NULL);
+    if (m_sock < 0)
+        return;
+    if ((flags = fcntl(m_sock, F_GETFL, 0)) < 0 || fcntl(m_sock, F_SETFL, flags | O_NONBLOCK) < 0){
+        ::close(m_sock);
+        m_sock = -1;
+        return;
+    }
+    m_loop->add(m_sock, &m_io);
+}
+
+AsyncServer::~AsyncServer()
+{
+    close();
+}
+
+bool AsyncServer::isOpen()
+{
+    return m_sock >= 0;
+}
+
+Task<std::unique_ptr<AsyncConnection>> AsyncServer::accept(EventLoop *target)
+{
+    std::unique_ptr<AsyncConnection> conn;
+    struct sockaddr_in client;
+    socklen_t len;
+    int sock;
+
+    while (m_sock >= 0){
+        len = sizeof(client);
+        sock = accept4(m_sock, (struct sockaddr *)&client, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock >= 0){
+            if (m_nc.socket_options(sock, SOCK_STREAM) < 0){
+                ::close(sock);
+                continue;
+            }
+            conn.reset(new AsyncConnection(target ? target : m_loop, sock, true, &m_nc.get_options()));
+            strcpy(conn->m_remote.szip, inet_ntoa(client.sin_addr));
+            conn->m_remote.port = ntohs(client.sin_port);
+            co_return std::move(conn);
+        }
+        if (errno == EAGAIN)
+            co_await m_loop->readable(&m_io);
+        else if (errno != EINTR && errno != ECONNABORTED){
+            perror("accept");
+            co_return nullptr;
+        }
+    }
+    co_return nullptr;
+}
+
+void AsyncServer::close()
+{
+    if (m_sock < 0)
+        return;
+    m_loop->del(m_sock, &m_io);
+    ::close(m_sock);
+    m_sock = -1;
+    if (m_io.reader)
+        m_loop->post(std::exchange(m_io.reader, nullptr));
+}
+
+#endif // C++20 coroutines
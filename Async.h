@@ -0,0 +1,343 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+//Coroutine API over epoll event loops, it needs C++20(CONFIG += c++2a) and is left out of
+//C++11 builds. It runs its own sockets next to DataTransmit, but both share the frame codec of
+//Transport.h and the control protocol of Control.h(version negotiation, heart beats and the
+//answers to control frames), so both ends can be mixed. Connections here keep the refusing
+//defaults of ControlDefaults: no shared memory, dedup or rpc, and no tracing.
+//  Task<void> echo(AsyncConnection *conn){
+//      while (auto msg = co_await conn->recv())
+//          co_await conn->send(msg->data(), msg->size());
+//  }
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+
+#include "DataTransmit.h"
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <utility>
+#include <type_traits>
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <deque>
+#include <unordered_map>
+#include <sys/epoll.h>
+
+template<class T=void> class Task;
+
+namespace async_detail{
+
+struct PromiseBase
+{
+    std::coroutine_handle<> m_continuation;
+    std::exception_ptr m_exception;
+
+    struct FinalAwaiter
+    {
+        bool await_ready() noexcept { return false; }
+        template<class P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            std::coroutine_handle<> next = h.promise().m_continuation;
+            return next ? next : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { m_exception = std::current_exception(); }
+};
+
+template<class T>
+struct Promise : PromiseBase
+{
+    std::optional<T> m_value;
+
+    Task<T> get_return_object();
+    template<class U> void return_value(U &&value) { m_value.emplace(std::forward<U>(value)); }
+};
+
+template<>
+struct Promise<void> : PromiseBase
+{
+    Task<void> get_return_object();
+    void return_void() {}
+};
+
+//fire and forget, frees itself when done
+struct Detached
+{
+    struct promise_type
+    {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+}
+
+//Lazy coroutine, starts when it is awaited and resumes the awaiter when it finishes
+template<class T>
+class Task
+{
+public:
+    typedef async_detail::Promise<T> promise_type;
+    typedef std::coroutine_handle<promise_type> handle_type;
+
+    explicit Task(handle_type h) : m_h(h) {}
+    Task(Task &&other) noexcept : m_h(std::exchange(other.m_h, {})) {}
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task() { if (m_h) m_h.destroy(); }
+
+    bool await_ready() noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+    {
+        m_h.promise().m_continuation = awaiter;
+        return m_h;
+    }
+    T await_resume()
+    {
+        if (m_h.promise().m_exception)
+            std::rethrow_exception(m_h.promise().m_exception);
+        if constexpr (!std::is_void_v<T>)
+            return std::move(*m_h.promise().m_value);
+    }
+
+private:
+    handle_type m_h;
+};
+
+template<class T>
+Task<T> async_detail::Promise<T>::get_return_object()
+{
+    return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> async_detail::Promise<void>::get_return_object()
+{
+    return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+//Single-threaded event loop, every coroutine of a connection runs on the loop that owns it
+class EventLoop
+{
+public:
+    //readiness of one fd, a waiter is resumed or the event is kept for the next wait
+    struct IoState{
+        std::coroutine_handle<> reader;
+        std::coroutine_handle<> writer;
+        bool readready;
+        bool writeready;
+    };
+
+    EventLoop();
+    ~EventLoop();
+    void run();             //until stop(), on the calling thread
+    void stop();            //from any thread
+    void post(std::coroutine_handle<> h);   //resume h on the loop, from any thread
+    void spawn(Task<void> task);            //start a flow on the loop, from any thread
+    bool isLoopThread();
+    int  add(int fd, IoState *io);
+    void del(int fd, IoState *io);
+    //run fn on the loop after ms, return an id for cancel(loop thread only)
+    uint64_t callAfter(int ms, std::function<void()> fn);
+    void cancel(uint64_t id);
+    static uint64_t now();  //CLOCK_MONOTONIC ms
+
+    //co_await loop->schedule() moves the coroutine onto the loop
+    struct ScheduleAwaiter{
+        EventLoop *loop;
+        bool await_ready() noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h) { loop->post(h); }
+        void await_resume() noexcept {}
+    };
+    struct IoAwaiter{
+        IoState *io;
+        bool forwrite;
+        bool await_ready() noexcept;
+        void await_suspend(std::coroutine_handle<> h) noexcept;
+        void await_resume() noexcept {}
+    };
+    struct SleepAwaiter{
+        EventLoop *loop;
+        int ms;
+        bool await_ready() noexcept { return ms <= 0; }
+        void await_suspend(std::coroutine_handle<> h) { loop->callAfter(ms, [l = loop, h]{ l->post(h); }); }
+        void await_resume() noexcept {}
+    };
+    ScheduleAwaiter schedule() { return ScheduleAwaiter{this}; }
+    SleepAwaiter sleep(int ms) { return SleepAwaiter{this, ms}; }
+    IoAwaiter readable(IoState *io) { return IoAwaiter{io, false}; }
+    IoAwaiter writable(IoState *io) { return IoAwaiter{io, true}; }
+
+private:
+    typedef std::multimap<uint64_t, std::pair<uint64_t, std::function<void()>>> TIMERS;
+
+    int m_epfd;
+    int m_wakefd;
+    std::atomic<bool> m_isstop;
+    std::atomic<std::thread::id> m_thread;
+    std::mutex m_mtx;
+    std::vector<std::coroutine_handle<>> m_posted;  //from other threads, under m_mtx
+    std::vector<std::coroutine_handle<>> m_ready;   //loop thread only
+    TIMERS m_timers;                                //by deadline
+    std::unordered_map<uint64_t, TIMERS::iterator> m_timerids;
+    uint64_t m_nexttimer;
+
+    int  timeout();
+    void runTimers();
+};
+
+//Loops run by their own threads, connections are spread over them
+class EventLoopGroup
+{
+public:
+    explicit EventLoopGroup(int count);
+    ~EventLoopGroup();
+    void start();
+    void stop();
+    EventLoop *get(int i);
+    EventLoop *next();      //round robin
+    int  size();
+
+private:
+    std::vector<std::unique_ptr<EventLoop>> m_loops;
+    std::vector<std::thread> m_threads;
+    std::atomic<unsigned int> m_next;
+};
+
+//Framed connection, one recv and any number of sends may be pending at a time
+//it must be destroyed on its loop after the flows using it have finished
+class AsyncConnection : private ControlDefaults
+{
+public:
+    ~AsyncConnection();
+    static Task<std::unique_ptr<AsyncConnection>> connect(EventLoop *loop, const char *ip, int port,
+                                                          const TRANSPORT_OPTS *opts=NULL);
+    //queue one message, completes once it is written or queued behind a running write
+    //waits while more than sendlimit bytes are queued, return len or -1
+    Task<int> send(const char *buf, int len);
+    //next message, nullopt once the connection is closed
+    Task<std::optional<std::vector<char>>> recv();
+    void close();
+    bool isOpen();
+    EventLoop *loop();
+    HOST_INFO getRemote();
+    void getResyncStats(unsigned long *events, unsigned long *skipped);
+
+private:
+    friend class AsyncServer;
+    friend class LinkControl<AsyncConnection>;
+
+    EventLoop *m_loop;
+    int  m_sock;
+    bool m_isserver;
+    int  m_wirever;
+    bool m_isflushing;
+    NetCore m_nc;
+    HOST_INFO m_remote;
+    unsigned char m_sign[8];
+    unsigned char m_key[16];
+    std::vector<char> m_in;
+    size_t m_inused;
+    std::unique_ptr<FrameDecoder<TcpTransport>> m_decoder;
+    std::deque<std::vector<char>> m_inmsgs;     //decoded and not taken by recv yet
+    std::atomic<unsigned long> m_resyncs;
+    std::atomic<unsigned long> m_resyncbytes;
+    std::vector<char> m_out;
+    size_t m_outoff;
+    uint64_t m_hbtimer;     //0 until the first send or recv on the loop arms it
+    std::vector<std::coroutine_handle<>> m_drainwait;
+    EventLoop::IoState m_io;
+
+    struct DrainAwaiter{
+        AsyncConnection *conn;
+        bool await_ready() noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h) { conn->m_drainwait.push_back(h); }
+        void await_resume() noexcept {}
+    };
+
+    AsyncConnection(EventLoop *loop, int sock, bool isserver, const TRANSPORT_OPTS *opts);
+    Task<int> flush();
+    void writeout();
+    void kick();
+    void wakedrain();
+    size_t pending();
+    void startheartbeat();
+    void heartbeat();
+    void queueframe(int kind, const char *buf, int len);
+    int  sendcontrol(int type, const char *data, int len, bool toshm, int newver);
+    int  sendheartbeat();
+    int  sendpending();
+    void setversion(int ver);
+    void onframe(const FRAME_INFO *fi, char *plain);
+};
+
+class AsyncServer
+{
+public:
+    AsyncServer(EventLoop *loop, int port, const char *ip=NULL, const TRANSPORT_OPTS *opts=NULL);
+    ~AsyncServer();
+    bool isOpen();
+    //next connection registered on target(the server loop if NULL), nullptr once closed
+    //the caller moves to target with co_await target->schedule() before using it
+    Task<std::unique_ptr<AsyncConnection>> accept(EventLoop *target=NULL);
+    void close();
+
+private:
+    EventLoop *m_loop;
+    int m_sock;
+    NetCore m_nc;
+    EventLoop::IoState m_io;
+};
+
+//run task on a loop driven by another thread and block until it finishes,
+//this is how blocking code calls into the coroutine API
+template<class T>
+T sync_wait(EventLoop *loop, Task<T> task)
+{
+    std::mutex mtx;
+    std::condition_variable cond;
+    bool done = false;
+    std::exception_ptr error;
+    std::conditional_t<std::is_void_v<T>, bool, std::optional<T>> result;
+
+    auto runner = [&](Task<T> t) -> async_detail::Detached {
+        co_await loop->schedule();
+        try{
+            if constexpr (std::is_void_v<T>)
+                co_await t;
+            else
+                result.emplace(co_await t);
+        }catch (...){
+            error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(mtx);
+        done = true;
+        cond.notify_one();
+    };
+    runner(std::move(task));
+
+    std::unique_lock<std::mutex> lock(mtx);
+    cond.wait(lock, [&]{ return done; });
+    if (error)
+        std::rethrow_exception(error);
+    if constexpr (!std::is_void_v<T>)
+        return std::move(*result);
+}
+
+#endif // C++20 coroutines
+
+#endif // ASYNC_H
@@ -0,0 +1,274 @@
+#include "Capture.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+static int put_varint(unsigned char *out, uint64_t val)
+{
+    int n = 0;
+
+    while (val >= 0x80){
+        out[n++] = (unsigned char)(val | 0x80);
+        val >>= 7;
+    }
+    out[n++] = (unsigned char)val;
+    return n;
+}
+
+Capture::Capture()
+{
+    m_fp = NULL;
+    m_buf = m_wbuf = NULL;
+    m_used = m_size = 0;
+    m_isopen = false;
+    m_isstop = false;
+    m_start = m_last = 0;
+    m_recorded = m_dropped = 0;
+    pthread_mutex_init(&m_mtx, NULL);
+    pthread_cond_init(&m_cond, NULL);
+}
+
+Capture::~Capture()
+{
+    Close();
+    pthread_mutex_destroy(&m_mtx);
+    pthread_cond_destroy(&m_cond);
+}
+
+uint64_t Capture::now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int Capture::Open(const char *path, int bufsize)
+{
+    char head[24];
+    struct timespec ts;
+    uint64_t wall;
+    unsigned int ver;
+
+    if (m_isopen)
+        return -1;
+    m_fp = fopen(path, "wb");
+    if (m_fp == NULL){
+        perror("fopen");
+        return -1;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    wall = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    ver = CAPTURE_VERSION;
+    memset(head, 0, sizeof(head));
+    memcpy(head, CAPTURE_MAGIC, 8);
+    memcpy(head+8, &ver, 4);
+    memcpy(head+16, &wall, 8);
+    if (fwrite(head, sizeof(head), 1, m_fp) != 1){
+        fclose(m_fp);
+        m_fp = NULL;
+        return -2;
+    }
+
+    m_size = bufsize;
+    m_buf = (char *)malloc(m_size);
+    m_wbuf = (char *)malloc(m_size);
+    m_used = 0;
+    m_recorded = m_dropped = 0;
+    m_start = m_last = now();
+    m_isstop = false;
+    if (pthread_create(&m_ptd_writer, NULL, writer, this) != 0){
+        free(m_buf);
+        free(m_wbuf);
+        fclose(m_fp);
+        m_fp = NULL;
+        return -3;
+    }
+    m_isopen = true;
+    return 0;
+}
+
+void Capture::Close()
+{
+    void *tret;
+
+    if (!m_isopen)
+        return;
+    pthread_mutex_lock(&m_mtx);
+    m_isopen = false;
+    m_isstop = true;
+    pthread_cond_signal(&m_cond);
+    pthread_mutex_unlock(&m_mtx);
+    pthread_join(m_ptd_writer, &tret);
+
+    fclose(m_fp);
+    m_fp = NULL;
+    free(m_buf);
+    free(m_wbuf);
+    m_buf = m_wbuf = NULL;
+}
+
+void Capture::Record(unsigned int connid, int dir, const char *buf, int len)
+{
+    unsigned char *p;
+    uint64_t ts, delta;
+    int n;
+
+    pthread_mutex_lock(&m_mtx);
+    if (!m_isopen || m_used + len + CAPTURE_REC_HEAD > m_size){
+        if (m_isopen)
+            m_dropped++;
+        pthread_mutex_unlock(&m_mtx);
+        return;
+    }
+    //time is taken under the lock so deltas never go backwards
+    ts = now();
+    delta = ts - m_last;
+    m_last = ts;
+
+    p = (unsigned char *)m_buf + m_used;
+    n = 0;
+    p[n++] = (unsigned char)dir;
+    n += put_varint(p+n, delta);
+    n += put_varint(p+n, connid);
+    n += put_varint(p+n, len);
+    memcpy(p+n, buf, len);
+    m_used += n + len;
+    m_recorded++;
+    if (m_used > m_size / 2)
+        pthread_cond_signal(&m_cond);
+    pthread_mutex_unlock(&m_mtx);
+}
+
+unsigned long Capture::GetRecorded()
+{
+    return m_recorded;
+}
+
+unsigned long Capture::GetDropped()
+{
+    return m_dropped;
+}
+
+void *Capture::writer(void *param)
+{
+    Capture *cap = (Capture *)param;
+    struct timespec ts;
+    char *wbuf;
+    int len;
+    bool isstop;
+
+    while (true){
+        pthread_mutex_lock(&cap->m_mtx);
+        if (cap->m_used == 0 && !cap->m_isstop){
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += CAPTURE_FLUSH_MS * 1000000L;
+            if (ts.tv_nsec >= 1000000000L){
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&cap->m_cond, &cap->m_mtx, &ts);
+        }
+        //swap buffers, Record keeps filling the other one while this one is written
+        wbuf = cap->m_buf;
+        cap->m_buf = cap->m_wbuf;
+        cap->m_wbuf = wbuf;
+        len = cap->m_used;
+        cap->m_used = 0;
+        isstop = cap->m_isstop;
+        pthread_mutex_unlock(&cap->m_mtx);
+
+        if (len > 0 && fwrite(wbuf, len, 1, cap->m_fp) != 1)
+            perror("fwrite");
+        if (isstop)
+            break;
+        fflush(cap->m_fp);
+    }
+    fflush(cap->m_fp);
+    return NULL;
+}
+
+CaptureReader::CaptureReader()
+{
+    m_fp = NULL;
+    m_start = m_ts = 0;
+}
+
+CaptureReader::~CaptureReader()
+{
+    Close();
+}
+
+int CaptureReader::Open(const char *path)
+{
+    char head[24];
+
+    Close();
+    m_fp = fopen(path, "rb");
+    if (m_fp == NULL){
+        perror("fopen");
+        return -1;
+    }
+    if (fread(head, sizeof(head), 1, m_fp) != 1 || memcmp(head, CAPTURE_MAGIC, 8) != 0){
+        Close();
+        return -2;
+    }
+    memcpy(&m_start, head+16, 8);
+    m_ts = 0;
+    return 0;
+}
+
+void CaptureReader::Close()
+{
+    if (m_fp)
+        fclose(m_fp);
+    m_fp = NULL;
+}
+
+uint64_t CaptureReader::GetStartTime()
+{
+    return m_start;
+}
+
+int CaptureReader::getvarint(uint64_t *val)
+{
+    int c, i;
+
+    *val = 0;
+    for (i=0; i<10; i++){
+        c = fgetc(m_fp);
+        if (c == EOF)
+            return -1;
+        *val |= (uint64_t)(c & 0x7f) << (7*i);
+        if (!(c & 0x80))
+            return 0;
+    }
+    return -1;
+}
+
+int CaptureReader::Next(PCR rec, char *buf, int maxlen)
+{
+    uint64_t delta, connid, len;
+    int dir;
+
+    if (m_fp == NULL)
+        return -1;
+    dir = fgetc(m_fp);
+    if (dir == EOF)
+        return -1;
+    if (getvarint(&delta) < 0 || getvarint(&connid) < 0 || getvarint(&len) < 0)
+        return -1;
+    m_ts += delta;
+    rec->ts = m_ts;
+    rec->connid = (unsigned int)connid;
+    rec->dir = dir;
+    rec->len = (int)len;
+    if ((int)len > maxlen){
+        fseek(m_fp, len, SEEK_CUR);
+        return -2;
+    }
+    if (len > 0 && fread(buf, len, 1, m_fp) != 1)
+        return -1;
+    return (int)len;
+}
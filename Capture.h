@@ -0,0 +1,82 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+//Capture file
+//  head: magic(8) version(4) reserved(4) start time(8, ns since epoch)
+//  record: dir(1) varint ts delta(ns) varint connid varint len payload
+#define CAPTURE_MAGIC "DTCAP\0\0\0"
+#define CAPTURE_VERSION 1
+#define CAPTURE_BUFFER 16*1024*1024
+#define CAPTURE_FLUSH_MS 100
+#define CAPTURE_REC_HEAD 24     //longest record head
+
+//Record direction
+#define CAPTURE_SEND 0
+#define CAPTURE_RECV 1
+
+typedef struct CAPTURE_REC{
+    uint64_t ts;            //ns since capture start
+    unsigned int connid;
+    int dir;
+    int len;
+}CR, *PCR;
+
+//Records messages as SendData takes them and the callback function gets them, not the
+//frames on the wire, into a double buffer, a background thread writes it out.
+//Record never blocks on the disk, records that do not fit are dropped and counted.
+class Capture
+{
+public:
+    Capture();
+    ~Capture();
+    int  Open(const char *path, int bufsize=CAPTURE_BUFFER);
+    void Close();
+    void Record(unsigned int connid, int dir, const char *buf, int len);
+    unsigned long GetRecorded();
+    unsigned long GetDropped();
+
+private:
+    FILE *m_fp;
+    char *m_buf;            //filled by Record
+    char *m_wbuf;           //written by the writer thread
+    int  m_used;
+    int  m_size;
+    bool m_isopen;
+    bool m_isstop;
+    uint64_t m_start;
+    uint64_t m_last;
+    unsigned long m_recorded;
+    unsigned long m_dropped;
+    pthread_mutex_t m_mtx;
+    pthread_cond_t m_cond;
+    pthread_t m_ptd_writer;
+
+    static uint64_t now();
+    static void *writer(void *param);
+};
+
+class CaptureReader
+{
+public:
+    CaptureReader();
+    ~CaptureReader();
+    int  Open(const char *path);
+    void Close();
+    //read the next record, return payload length, -1 at the end of file
+    //-2 if the payload is longer than maxlen, rec is filled and the payload skipped
+    int  Next(PCR rec, char *buf, int maxlen);
+    uint64_t GetStartTime();
+
+private:
+    FILE *m_fp;
+    uint64_t m_start;
+    uint64_t m_ts;
+
+    int  getvarint(uint64_t *val);
+};
+
+#endif // CAPTURE_H
@@ -7,6 +7,16 @@
 #define MAX_DATA_LEN 4*1024*1024
 #define MAX_RECV_LEN 10*1024*1024
 
+//Non-blocking send buffer(bytes)
+#define SEND_BUFFER_LIMIT 16*1024*1024
+#define SEND_HIGH_WATERMARK 8*1024*1024
+#define SEND_LOW_WATERMARK 2*1024*1024
+#define SEND_WOULDBLOCK -2
+
+//Shared memory ring per direction for same-host peers(bytes), 0 disables it
+#define SHM_RING_SIZE 4*1024*1024
+#define SHM_SPIN 0
+
 //Port
 #define DATA_PORT 8301
 #define FILE_PORT 8302
@@ -19,6 +29,51 @@
 #define ACCEPT_TIME -1      //-1 means infinitely
 #define HEARTBEAT_INTERVAL 5
 
+//Socket
+#define LISTEN_BACKLOG 4
+
+//Multicast
+#define MCAST_TTL 1
+#define MCAST_LOOP 1
+#define MCAST_MAX_DATAGRAM 65507
+#define MCAST_MAX_SOURCES 256       //publishers whose sequence numbers a subscriber follows
+
+//Chunk cache per direction for dedup mode(bytes of chunk data), the smaller of the two ends is used
+#define DEDUP_CACHE_SIZE 64*1024*1024
+
+//Send pacing, 0 means unlimited
+#define PACING_RATE 0               //bytes per second
+#define PACING_BURST 64*1024        //bytes sent back to back after an idle period
+
+//Connection state
+enum CONN_STATE{
+    CS_IDLE = 0,        //InitialConnection not called yet
+    CS_CONNECTING,      //connecting or listening
+    CS_CONNECTED,
+    CS_DISCONNECTED,    //link dropped, waiting for reconnect
+    CS_STOPPING,
+    CS_STOPPED
+};
+
+//Block head sign and RC4 key, shared by every connection type
+#define BH_SIGN "\xf9\x9f\xec\xff\xff\x0a\x9f\xf9"
+#define CRYPT_KEY "\x00\x03\x00\x02\x07\x00\x05\x06\x0a\x05\x06\x0b\x05\x06\x06\x0b"
+
+//Block head flag
+#define BH_FLAG_CONTROL 0x1     //payload is a control message, checksum is inverted so old peers drop it
+#define CONTROL_MAX_LEN 128
+
+//Control message type, first byte of a control payload
+enum CONTROL_TYPE{
+    CT_SHM_OFFER = 1,   //connector created a shared memory segment, payload is its name, a 0 and varint maxdatalen
+    CT_SHM_ACCEPT,      //listener attached, following listener data goes through shared memory, payload is varint maxdatalen
+    CT_SHM_REJECT,
+    CT_SHM_SWITCH,      //following connector data goes through shared memory
+    CT_VERSION,         //highest wire format version supported, the listener answers with the chosen one
+    CT_DEDUP,           //varint chunk cache size, the listener answers with the chosen one if it dedups too
+    CT_RPC              //empty, rpc heads may be sent as FO_RPC, the listener answers if it reads them too
+};
+
 //Struct
 typedef struct BLOCK_HEAD{
     char sign[8];
@@ -27,11 +82,63 @@ typedef struct BLOCK_HEAD{
     unsigned int chksum;
 }BH, *PBH;
 
+//Per-instance transport options, macros above are the defaults
+typedef struct TRANSPORT_OPTS{
+    int nodelay;            //TCP_NODELAY
+    int quickack;           //TCP_QUICKACK, rearmed after every recv
+    int sndbuf;             //SO_SNDBUF, 0 means system default
+    int rcvbuf;             //SO_RCVBUF, 0 means system default
+    int busypoll;           //SO_BUSY_POLL(us), 0 means disabled
+    int tos;                //IP_TOS, -1 means system default
+    int priority;           //SO_PRIORITY, -1 means system default
+    int backlog;            //listen backlog
+    int linger;             //SO_LINGER timeout(second), 0 resets on close, -1 means graceful close
+    int maxdatalen;
+    int maxrecvlen;
+    int conninterval;       //second
+    int conntimeout;        //second
+    int recvtimeout;        //second
+    int accepttimeout;      //second
+    int heartbeatinterval;  //second
+    int sendlimit;          //non-blocking send buffer(bytes)
+    int highmark;
+    int lowmark;
+    int shmsize;            //shared memory ring size for local peers, 0 means tcp only
+    int shmspin;            //spin iterations before blocking on an empty or full ring
+    int mcastttl;           //IP_MULTICAST_TTL, 1 keeps datagrams on the local network
+    int mcastloop;          //IP_MULTICAST_LOOP, subscribers on the publishing host get a copy
+    int dedupcache;         //chunk cache size of dedup mode
+    int pacingrate;         //send rate limit(bytes/s) of the connection, 0 means unlimited
+    int pacingburst;
+    int pacingfq;           //SO_MAX_PACING_RATE too, the kernel spaces packets(udp needs the fq qdisc)
+}TO, *PTO;
+
 typedef struct HOST_INFO{
     char szip[16];
     unsigned short port;
 }*PHI;
 
+//one encoded frame queued to several connections, freed with the last reference
+typedef struct SHARED_FRAME{
+    int refs;           //changed with atomic builtins
+    int len;
+    unsigned long long stamp;   //trace stamp of encode done, 0 if not traced
+    char data[1];
+}SF, *PSF;
+
+//one encoded message waiting in the outbound buffer
+typedef struct SEND_BLOCK{
+    struct SEND_BLOCK *next;
+    struct SHARED_FRAME *shared;    //data is in the shared frame when set
+    int len;
+    int off;            //bytes already sent
+    bool paced;         //tokens taken from the pacing buckets
+    unsigned long long stamp;   //trace stamp of encode done, 0 if not traced
+    char data[1];
+}SB, *PSB;
+
 typedef void (*callback_t)(char *buf, int len);
+typedef void (*notify_t)(int buffered);
+typedef void (*rpchook_t)(void *ctx, const unsigned char *head, int headlen, char *buf, int len);
 
 #endif // CMNHDR_H
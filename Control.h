@@ -0,0 +1,102 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include "CmnHdr.h"
+#include "WireFormat.h"
+
+//Control protocol of a tcp link: version negotiation, heart beats and the answers to control
+//frames. DataTransmit and AsyncConnection both run it through LinkControl, so the two stacks
+//agree on every frame and only differ in the features they have.
+//L is the link and provides
+//  int  sendcontrol(int type, const char *data, int len, bool toshm, int newver)
+//  int  sendheartbeat()        //queue or write one heart beat frame, -1 once the link is down
+//  int  sendpending()          //bytes waiting to go out before a heart beat would
+//  void setversion(int ver)    //following frames use wire format ver
+//  the features of ControlDefaults, a link without one keeps the default
+
+//Features a link may lack, their defaults refuse or ignore the peer's offer
+class ControlDefaults
+{
+public:
+    void offershm() {}
+    void offerdedup() {}
+    void offerrpc() {}
+    bool attachshm(char *, int) { return false; }   //true once CT_SHM_ACCEPT has been sent
+    void onshmaccept(char *, int) {}
+    void onshmreject() {}
+    void onshmswitch() {}
+    void ondedup(char *, int) {}    //a link without dedup does not answer
+    void onrpc() {}                 //a link without rpc does not answer
+    void errMsg(const char *, ...) {}
+};
+
+template<class L>
+class LinkControl
+{
+public:
+    //first frames of a new link, the connector asks and the listener answers
+    static void start(L *link, bool isserver)
+    {
+        char ver;
+
+        if (isserver)
+            return;
+        ver = FRAME_VERSION;
+        link->sendcontrol(CT_VERSION, &ver, 1, false, 0);
+        link->offerdedup();
+        link->offerrpc();
+        link->offershm();
+    }
+
+    //one heart beat tick, return -1 once the link is down
+    static int heartbeat(L *link)
+    {
+        //frames waiting to go out show the peer the link is alive anyway
+        if (link->sendpending() > 0)
+            return 0;
+        return link->sendheartbeat() < 0 ? -1 : 0;
+    }
+
+    //one control frame from the peer, type is its first byte
+    static void oncontrol(L *link, bool isserver, int type, char *data, int len)
+    {
+        char ver;
+
+        switch (type){
+        case CT_SHM_OFFER:
+            if (!link->attachshm(data, len))
+                link->sendcontrol(CT_SHM_REJECT, NULL, 0, false, 0);
+            break;
+        case CT_SHM_ACCEPT:
+            link->onshmaccept(data, len);
+            break;
+        case CT_SHM_REJECT:
+            link->onshmreject();
+            break;
+        case CT_SHM_SWITCH:
+            link->onshmswitch();
+            break;
+        case CT_VERSION:
+            ver = WireFormat::agree_version(data, len);
+            if (ver == 0)
+                break;
+            //the answer is the last frame in the old format
+            if (isserver)
+                link->sendcontrol(CT_VERSION, &ver, 1, false, ver);
+            else
+                link->setversion(ver);
+            link->errMsg("wire format v%d", ver);
+            break;
+        case CT_DEDUP:
+            link->ondedup(data, len);
+            break;
+        case CT_RPC:
+            link->onrpc();
+            break;
+        default:
+            break;
+        }
+    }
+};
+
+#endif // CONTROL_H
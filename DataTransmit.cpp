@@ -1,23 +1,117 @@
 #include "DataTransmit.h"
 
+NetCore::NetCore()
+{
+    default_options(&m_opts);
+}
+
+void NetCore::default_options(struct TRANSPORT_OPTS *opts)
+{
+    opts->nodelay = 0;
+    opts->quickack = 0;
+    opts->sndbuf = 0;
+    opts->rcvbuf = 0;
+    opts->busypoll = 0;
+    opts->tos = -1;
+    opts->priority = -1;
+    opts->backlog = LISTEN_BACKLOG;
+    opts->linger = 0;
+    opts->maxdatalen = MAX_DATA_LEN;
+    opts->maxrecvlen = MAX_RECV_LEN;
+    opts->conninterval = CONN_INTERVAL;
+    opts->conntimeout = CONN_TIMEOUT;
+    opts->recvtimeout = RECV_TIMEOUT;
+    opts->accepttimeout = ACCEPT_TIMEOUT;
+    opts->heartbeatinterval = HEARTBEAT_INTERVAL;
+    opts->sendlimit = SEND_BUFFER_LIMIT;
+    opts->highmark = SEND_HIGH_WATERMARK;
+    opts->lowmark = SEND_LOW_WATERMARK;
+    opts->shmsize = SHM_RING_SIZE;
+    opts->shmspin = SHM_SPIN;
+    opts->mcastttl = MCAST_TTL;
+    opts->mcastloop = MCAST_LOOP;
+    opts->dedupcache = DEDUP_CACHE_SIZE;
+    opts->pacingrate = PACING_RATE;
+    opts->pacingburst = PACING_BURST;
+    opts->pacingfq = 0;
+}
+
+//small messages: no Nagle or delayed ack, busy poll, low-delay tos, fast reconnect
+void NetCore::low_latency_options(struct TRANSPORT_OPTS *opts)
+{
+    default_options(opts);
+    opts->nodelay = 1;
+    opts->quickack = 1;
+    opts->busypoll = 50;
+    opts->tos = IPTOS_LOWDELAY;
+    opts->priority = 6;
+    opts->backlog = 16;
+    opts->conninterval = 1;
+    opts->conntimeout = 1;
+    opts->heartbeatinterval = 1;
+    opts->sendlimit = 1024*1024;
+    opts->highmark = 512*1024;
+    opts->lowmark = 128*1024;
+    opts->shmspin = 20000;
+}
+
+//large transfers: big socket buffers, throughput tos, graceful close so queued data is delivered
+void NetCore::bulk_throughput_options(struct TRANSPORT_OPTS *opts)
+{
+    default_options(opts);
+    opts->sndbuf = 4*1024*1024;
+    opts->rcvbuf = 4*1024*1024;
+    opts->tos = IPTOS_THROUGHPUT;
+    opts->backlog = 64;
+    opts->linger = -1;
+    opts->sendlimit = 64*1024*1024;
+    opts->highmark = 32*1024*1024;
+    opts->lowmark = 8*1024*1024;
+}
+
+//sizes, limits, timeouts and the backlog must be positive, the watermarks within the limit
+bool NetCore::check_options(const struct TRANSPORT_OPTS *opts)
+{
+    if (opts->maxdatalen <= 0 || opts->maxrecvlen <= 0 || opts->maxdatalen > opts->maxrecvlen)
+        return false;
+    if (opts->sendlimit <= 0 || opts->highmark > opts->sendlimit || opts->lowmark > opts->highmark || opts->lowmark < 0)
+        return false;
+    if (opts->conntimeout <= 0 || opts->recvtimeout <= 0 || opts->accepttimeout <= 0 ||
+        opts->heartbeatinterval <= 0 || opts->conninterval < 0 || opts->backlog <= 0)
+        return false;
+    if (opts->shmsize < 0 || opts->dedupcache < 0)
+        return false;
+    return opts->pacingrate == 0 || (opts->pacingrate > 0 && opts->pacingburst > 0);
+}
+
+int NetCore::set_options(const struct TRANSPORT_OPTS *opts)
+{
+    if (!check_options(opts))
+        return -1;
+    m_opts = *opts;
+    return 0;
+}
+
+const struct TRANSPORT_OPTS &NetCore::get_options() const
+{
+    return m_opts;
+}
+
 int NetCore::socket_new(int type)
 {
     int sock, ret, sockopt;
-    struct linger fix_ling;
 
     sock = socket(PF_INET, type, 0);
     if (sock < 0)
         return -1;
 
-    fix_ling.l_onoff = 1;
-    fix_ling.l_linger = 0;
-    ret = setsockopt(sock, SOL_SOCKET, SO_LINGER, &fix_ling, sizeof(fix_ling));
+    sockopt = 1;
+    ret = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &sockopt, sizeof(sockopt));
     if (ret < 0){
         close(sock);
         return -2;
     }
-    sockopt = 1;
-    ret = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &sockopt, sizeof(sockopt));
+    ret = socket_options(sock, type);
     if (ret < 0){
         close(sock);
         return -2;
@@ -26,12 +120,110 @@ int NetCore::socket_new(int type)
     return sock;
 }
 
-int NetCore::socket_new_connect(int port, const struct in_addr *addr)
+//apply m_opts to a socket, only linger is fatal, the tuning options are best effort
+int NetCore::socket_options(int sock, int type)
+{
+    int ret, sockopt;
+    struct linger fix_ling;
+
+    if (m_opts.linger >= 0){
+        fix_ling.l_onoff = 1;
+        fix_ling.l_linger = m_opts.linger;
+        ret = setsockopt(sock, SOL_SOCKET, SO_LINGER, &fix_ling, sizeof(fix_ling));
+        if (ret < 0)
+            return -1;
+    }
+    if (m_opts.sndbuf > 0 && setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &m_opts.sndbuf, sizeof(int)) < 0)
+        perror("setsockopt SO_SNDBUF");
+    if (m_opts.rcvbuf > 0 && setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &m_opts.rcvbuf, sizeof(int)) < 0)
+        perror("setsockopt SO_RCVBUF");
+    if (m_opts.busypoll > 0 && setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &m_opts.busypoll, sizeof(int)) < 0)
+        perror("setsockopt SO_BUSY_POLL");
+    if (m_opts.tos >= 0 && setsockopt(sock, IPPROTO_IP, IP_TOS, &m_opts.tos, sizeof(int)) < 0)
+        perror("setsockopt IP_TOS");
+    if (m_opts.priority >= 0 && setsockopt(sock, SOL_SOCKET, SO_PRIORITY, &m_opts.priority, sizeof(int)) < 0)
+        perror("setsockopt SO_PRIORITY");
+    if (type == SOCK_STREAM){
+        sockopt = m_opts.nodelay ? 1 : 0;
+        if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &sockopt, sizeof(sockopt)) < 0)
+            perror("setsockopt TCP_NODELAY");
+        rearm_quickack(sock);
+    }
+    if (m_opts.pacingfq && m_opts.pacingrate > 0)
+        max_pacing(sock, m_opts.pacingrate);
+    return 0;
+}
+
+//TCP_QUICKACK is not permanent, the kernel may leave quickack mode after any recv
+void NetCore::rearm_quickack(int sock)
+{
+    int sockopt;
+
+    if (!m_opts.quickack)
+        return;
+    sockopt = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, &sockopt, sizeof(sockopt));
+}
+
+//tcp paces itself at SO_MAX_PACING_RATE, other sockets need the fq qdisc, rate 0 means unlimited
+int NetCore::max_pacing(int sock, int rate)
+{
+    unsigned int maxrate;
+
+    maxrate = rate > 0 ? rate : ~0U;
+    if (setsockopt(sock, SOL_SOCKET, SO_MAX_PACING_RATE, &maxrate, sizeof(maxrate)) < 0){
+        perror("setsockopt SO_MAX_PACING_RATE");
+        return -1;
+    }
+    return 0;
+}
+
+//software rx stamps, taken when the packet enters the network stack
+int NetCore::rx_timestamps(int sock)
+{
+    int flags;
+
+    flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0){
+        perror("setsockopt SO_TIMESTAMPING");
+        return -1;
+    }
+    return 0;
+}
+
+int NetCore::recv_stamped(int sock, char *buf, int len, uint64_t *rxts)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct scm_timestamping *stamp;
+    char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+    int ret;
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    *rxts = 0;
+    ret = recvmsg(sock, &msg, 0);
+    if (ret <= 0)
+        return ret;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING){
+            stamp = (struct scm_timestamping *)CMSG_DATA(cmsg);
+            *rxts = (uint64_t)stamp->ts[0].tv_sec * 1000000000ULL + stamp->ts[0].tv_nsec;
+        }
+    }
+    return ret;
+}
+
+int NetCore::socket_new_connect(int port, const struct in_addr *addr, int wakefd)
 {
     int sock, ret, error, flags;
     socklen_t len;
-    fd_set wset;
-    struct timeval tval;
     struct sockaddr_in rem_addr;
 
     assert(addr);
@@ -59,18 +251,13 @@ int NetCore::socket_new_connect(int port, const struct in_addr *addr)
         return -5;
     }
 
-    FD_ZERO(&wset);
-    FD_SET(sock, &wset);
-    tval.tv_sec = CONN_TIMEOUT;
-    tval.tv_usec = 0;
-
-    ret = select(sock+1, NULL, &wset, NULL, &tval);
+    ret = wait_fd(sock, true, m_opts.conntimeout*1000, wakefd);
     if (ret == 0){
         close(sock);
         return -6;
     }
 
-    if (FD_ISSET(sock, &wset)){
+    if (ret == 1){
         len = sizeof(error);
         ret = getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &len);
         if (ret < 0 || error){
@@ -81,6 +268,7 @@ int NetCore::socket_new_connect(int port, const struct in_addr *addr)
         }
     }
     else{
+        close(sock);
         return -8;
     }
 
@@ -111,7 +299,7 @@ int NetCore::socket_new_listen(int type, int port, const struct in_addr *addr)
         return -3;
     }
 
-    ret = listen(sock, 4);
+    ret = listen(sock, m_opts.backlog);
     if (ret < 0){
         close(sock);
         return -4;
@@ -119,38 +307,33 @@ int NetCore::socket_new_listen(int type, int port, const struct in_addr *addr)
     return sock;
 }
 
-int NetCore::socket_accept(int sockfd, int timeout, struct HOST_INFO *hostinfo)
+int NetCore::socket_accept(int sockfd, int timeout, struct HOST_INFO *hostinfo, int wakefd)
 {
-    fd_set in;
     int ret;
     int flag;
     socklen_t len;
-    struct timeval timest;
     struct sockaddr_in client;
 
     flag = 1;
 
     while (flag){
-        FD_ZERO(&in);
-        FD_SET(sockfd, &in);
-
-        timest.tv_sec = timeout;
-        timest.tv_usec = 0;
-
-        ret = select(sockfd+1, &in, NULL, NULL, &timest);
-        if (ret < 0){
-            if (errno == EINTR)
-                continue;
+        ret = wait_fd(sockfd, false, timeout*1000, wakefd);
+        if (ret == -1){
             perror("select");
             return -1;
         }
+        if (ret == -2)
+            return -2;
         if (ret == 0)
             continue;
 
-        if (FD_ISSET(sockfd, &in)){
+        if (ret == 1){
             int new_sock;
             len = sizeof(client);
             new_sock = accept(sockfd, (struct sockaddr*)&client, &len);
+            if (new_sock < 0)
+                continue;
+            socket_options(new_sock, SOCK_STREAM);
             strcpy(hostinfo->szip, inet_ntoa(client.sin_addr));
             hostinfo->port = ntohs(client.sin_port);
             return new_sock;
@@ -159,7 +342,7 @@ int NetCore::socket_accept(int sockfd, int timeout, struct HOST_INFO *hostinfo)
     return -1;
 }
 
-int NetCore::udp_connect(/*int localport, */int remoteport, const struct in_addr *addr)
+int NetCore::udp_connect(/*int localport, */int remoteport, const struct in_addr *addr, const struct in_addr *ifaddr)
 {
     int ret, sock;
     struct sockaddr_in myaddr;
@@ -167,6 +350,10 @@ int NetCore::udp_connect(/*int localport, */int remoteport, const struct in_addr
     sock = socket_new(SOCK_DGRAM);
     if (sock < 0)
         return -1;
+    if (IN_MULTICAST(ntohl(addr->s_addr)) && udp_multicast(sock, ifaddr) < 0){
+        close(sock);
+        return -2;
+    }
     myaddr.sin_family = AF_INET;
     /*myaddr.sin_port = htons(localport);
     myaddr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -186,9 +373,115 @@ int NetCore::udp_connect(/*int localport, */int remoteport, const struct in_addr
     return sock;
 }
 
+//publisher side, ttl and loopback come from m_opts, ifaddr selects the outgoing interface
+int NetCore::udp_multicast(int sock, const struct in_addr *ifaddr)
+{
+    int ttl, loop;
+
+    ttl = m_opts.mcastttl;
+    loop = m_opts.mcastloop ? 1 : 0;
+    if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0){
+        perror("setsockopt IP_MULTICAST_TTL");
+        return -1;
+    }
+    if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0){
+        perror("setsockopt IP_MULTICAST_LOOP");
+        return -1;
+    }
+    if (ifaddr != NULL && ifaddr->s_addr != htonl(INADDR_ANY) &&
+        setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, ifaddr, sizeof(*ifaddr)) < 0){
+        perror("setsockopt IP_MULTICAST_IF");
+        return -1;
+    }
+    return 0;
+}
+
+//subscriber side, ifaddr NULL or INADDR_ANY lets the kernel pick the interface
+int NetCore::udp_join(int sock, const struct in_addr *group, const struct in_addr *ifaddr)
+{
+    struct ip_mreq mreq;
+
+    mreq.imr_multiaddr = *group;
+    mreq.imr_interface.s_addr = ifaddr ? ifaddr->s_addr : htonl(INADDR_ANY);
+    if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0){
+        perror("setsockopt IP_ADD_MEMBERSHIP");
+        return -1;
+    }
+    return 0;
+}
+
+int NetCore::wait_fd(int sockfd, bool forwrite, int timeout, int wakefd, int wakefd2)
+{
+    fd_set rset, wset;
+    int ret, maxfd;
+    struct timeval timest;
+
+    while (true){
+        FD_ZERO(&rset);
+        FD_ZERO(&wset);
+        maxfd = -1;
+        if (sockfd >= 0){
+            FD_SET(sockfd, forwrite?&wset:&rset);
+            maxfd = sockfd;
+        }
+        if (wakefd >= 0){
+            FD_SET(wakefd, &rset);
+            if (wakefd > maxfd)
+                maxfd = wakefd;
+        }
+        if (wakefd2 >= 0){
+            FD_SET(wakefd2, &rset);
+            if (wakefd2 > maxfd)
+                maxfd = wakefd2;
+        }
+        timest.tv_sec = timeout / 1000;
+        timest.tv_usec = (timeout % 1000) * 1000;
+
+        ret = select(maxfd+1, &rset, &wset, NULL, timeout<0?NULL:&timest);
+        if (ret < 0){
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (ret == 0)
+            return 0;
+        if ((wakefd >= 0 && FD_ISSET(wakefd, &rset)) || (wakefd2 >= 0 && FD_ISSET(wakefd2, &rset)))
+            return -2;
+        return 1;
+    }
+}
+
+//a local address can be bound, peers on it share the host with us
+bool NetCore::is_local_addr(const struct in_addr *addr)
+{
+    int sock, ret;
+    struct sockaddr_in myaddr;
+
+    if ((ntohl(addr->s_addr) >> 24) == 127)
+        return true;
+    sock = socket(PF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+        return false;
+    memset(&myaddr, 0, sizeof(myaddr));
+    myaddr.sin_family = AF_INET;
+    myaddr.sin_port = 0;
+    memcpy(&myaddr.sin_addr, addr, sizeof(myaddr.sin_addr));
+    ret = bind(sock, (struct sockaddr *)&myaddr, sizeof(myaddr));
+    close(sock);
+    return ret == 0;
+}
+
 DataTransmit::~DataTransmit()
 {
     StopConnection();
+    clearblocks();
+    close(m_stopfd);
+    close(m_linkfd);
+    close(m_sendfd);
+    pthread_mutex_destroy(&m_sendmtx);
+    pthread_mutex_destroy(&m_writemtx);
+    pthread_mutex_destroy(&m_shmmtx);
+    pthread_mutex_destroy(&m_optsmtx);
 }
 
 DataTransmit::DataTransmit(const char *svr_ip, int svr_port)
@@ -244,28 +537,198 @@ void DataTransmit::resolveHost(const char *szname)
 
 void DataTransmit::initialParam()
 {
-    m_isterminate = false;
-    m_isconnect = false;
+    m_state = CS_IDLE;
+    m_isrunning = false;
+    m_conn_sock = -1;
+    m_stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    m_linkfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    m_sendfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
     m_isheartbeat = true;
     m_isudp = false;
     m_islocalip = false;
     m_issimplify = false;
+    m_ismulticast = false;
+    m_mcastgroup.s_addr = htonl(INADDR_ANY);
+    m_mcastif.s_addr = htonl(INADDR_ANY);
+    m_mcastseq = 0;
+    m_mcastrecv = 0;
+    m_mcastlost = 0;
+    m_isnonblock = false;
+    m_isdedup = false;
+    m_isabovehigh = false;
+    m_iswouldblock = false;
     m_callbackfunc = NULL;
-    m_sign[0] = 0xf9;
-    m_sign[1] = 0x9f;
-    m_sign[2] = 0xec;
-    m_sign[3] = 0xff;
-    m_sign[4] = 0xff;
-    m_sign[5] = 0x0a;
-    m_sign[6] = 0x9f;
-    m_sign[7] = 0xf9;
-    init_crc_table();
+    m_rpcfunc = NULL;
+    m_rpcctx = NULL;
+    m_isrpc = false;
+    m_sendopt = NULL;
+    m_capture = NULL;
+    m_connid = 0;
+    m_istrace = false;
+    m_tracesend = 0;
+    m_traceenc = 0;
+    m_rxts = 0;
+    m_recvts = 0;
+    m_highfunc = NULL;
+    m_lowfunc = NULL;
+    m_writablefunc = NULL;
+    m_sendbuffered = 0;
+    m_highpending = -1;
+    m_sendhead = NULL;
+    m_sendtail = NULL;
+    pthread_mutex_init(&m_sendmtx, NULL);
+    pthread_mutex_init(&m_writemtx, NULL);
+    pthread_mutex_init(&m_shmmtx, NULL);
+    pthread_mutex_init(&m_optsmtx, NULL);
+    NetCore::default_options(&m_nextopts);
+    m_isoptschanged = false;
+    m_isshmsend = false;
+    m_shmpeermax = 0;
+    m_isshmrecv = false;
+    m_wirever = 1;
+    m_resyncs = 0;
+    m_resyncbytes = 0;
+    m_ptd_connsvr = m_ptd_lsnclt = m_ptd_recv = m_ptd_heartbeat = m_ptd_send = m_ptd_shm = pthread_t();
+    memcpy(m_sign, BH_SIGN, 8);
     init_key();
+    selectTransport();
+}
+
+bool DataTransmit::isConnected()
+{
+    return m_state == CS_CONNECTED;
+}
+
+bool DataTransmit::isTerminate()
+{
+    int state = m_state;
+    return state == CS_STOPPING || state == CS_STOPPED;
+}
+
+void DataTransmit::linkUp(int sock)
+{
+    static std::atomic<unsigned int> connid(0);
+    eventfd_t val;
+    int expected = CS_CONNECTING;
+
+    eventfd_read(m_linkfd, &val);
+    //an accepted socket was set up while the old options were in force
+    if (applyoptions() && !m_isudp)
+        m_nc.socket_options(sock, SOCK_STREAM);
+    m_conn_sock = sock;
+    m_wirever = 1;
+    m_connid = ++connid;
+    selectTransport();
+    if (!m_state.compare_exchange_strong(expected, CS_CONNECTED)){
+        expected = CS_DISCONNECTED;
+        m_state.compare_exchange_strong(expected, CS_CONNECTED);
+    }
+}
+
+void DataTransmit::linkDown()
+{
+    int expected = CS_CONNECTED;
+
+    //only the first one who notices the drop changes state, a stop in progress is kept
+    m_state.compare_exchange_strong(expected, CS_DISCONNECTED);
+    eventfd_write(m_linkfd, 1);
+}
+
+//pick the transport instantiation for the link once, instead of checking the flags per message
+void DataTransmit::selectTransport()
+{
+    bool queued = m_isnonblock && !m_isudp;
+
+    if (m_issimplify && m_isudp)
+        usetransport<UdpRawTransport, false>();
+    else if (m_issimplify && queued)
+        usetransport<TcpRawTransport, true>();
+    else if (m_issimplify)
+        usetransport<TcpRawTransport, false>();
+    else if (m_isudp)
+        usetransport<UdpTransport, false>();
+    else if (queued)
+        usetransport<TcpTransport, true>();
+    else
+        usetransport<TcpTransport, false>();
+    //one datagram per message for every subscriber, framed like udp
+    if (m_ismulticast && !m_issimplify)
+        m_sendfunc = &DataTransmit::senddatamulticast;
+}
+
+//point the per-link functions at transport T, queued links hand their frames to the send thread
+template<class T, bool queued>
+void DataTransmit::usetransport()
+{
+    m_sendfunc = queued ? &DataTransmit::queuemessage<T> : &DataTransmit::writemessage<T>;
+    m_groupfunc = queued ? &DataTransmit::queuegroup<T> : NULL;
+    m_framefunc = &DataTransmit::sendframe<T, queued>;
+    m_recvfunc = recv_link<T>;
+}
+
+//run one established link until it drops or the connection is stopped
+void DataTransmit::runLink()
+{
+    void *tret;
+    bool hasheartbeat;
+    bool hassend;
+    int expected;
+
+    clearblocks();
+    //chunk caches start empty on every link
+    pthread_mutex_lock(&m_writemtx);
+    m_dedup.Stop();
+    m_isrpc = false;
+    m_shmpeermax = 0;
+    pthread_mutex_unlock(&m_writemtx);
+    if (m_istrace && !m_isudp)
+        m_nc.rx_timestamps(m_conn_sock);
+    pthread_create(&m_ptd_recv, NULL, m_recvfunc, this);
+    hasheartbeat = m_isheartbeat && pthread_create(&m_ptd_heartbeat, NULL, heart_beat, this) == 0;
+    hassend = m_isnonblock && !m_isudp && pthread_create(&m_ptd_send, NULL, send_data, this) == 0;
+    if (!m_isudp && !m_issimplify)
+        LinkControl<DataTransmit>::start(this, m_isserver);
+    pthread_join(m_ptd_recv, &tret);
+    m_ptd_recv = pthread_t();
+
+    linkDown();
+    stopshm();
+    if (hasheartbeat)
+        pthread_join(m_ptd_heartbeat, &tret);
+    if (hassend)
+        pthread_join(m_ptd_send, &tret);
+    m_ptd_send = pthread_t();
+    //outstanding rpc calls are not answered on the next link
+    if (m_rpcfunc != NULL)
+        m_rpcfunc(m_rpcctx, NULL, -1, NULL, 0);
+    clearblocks();
+    shutdown(m_conn_sock, SHUT_RDWR);
+    pthread_mutex_lock(&m_writemtx);
+    close(m_conn_sock);
+    m_conn_sock = -1;
+    pthread_mutex_unlock(&m_writemtx);
+    expected = CS_DISCONNECTED;
+    m_state.compare_exchange_strong(expected, CS_CONNECTING);
 }
 
 void DataTransmit::InitialConnection()
 {
     int err;
+    void *tret;
+    eventfd_t val;
+
+    if (m_isrunning){
+        //a stop from the callback function left the connection thread to exit by itself
+        if (m_state != CS_STOPPING || isownthread())
+            return;
+        pthread_join(m_isserver ? m_ptd_lsnclt : m_ptd_connsvr, &tret);
+        m_isrunning = false;
+    }
+    eventfd_read(m_stopfd, &val);
+    eventfd_read(m_linkfd, &val);
+    applyoptions();
+    m_state = CS_CONNECTING;
+
     if (m_isserver)
     {
         if (!m_isudp)
@@ -273,9 +736,9 @@ void DataTransmit::InitialConnection()
         else
         {
             if (m_issimplify)
-                err = pthread_create(&m_ptd_lsnclt, NULL, udp_clt_simplify, this);
+                err = pthread_create(&m_ptd_lsnclt, NULL, udp_listen<UdpRawTransport>, this);
             else
-                err = pthread_create(&m_ptd_lsnclt, NULL, udp_clt, this);
+                err = pthread_create(&m_ptd_lsnclt, NULL, udp_listen<UdpTransport>, this);
         }
     }
     else
@@ -283,14 +746,41 @@ void DataTransmit::InitialConnection()
         err = pthread_create(&m_ptd_connsvr, NULL, connect_svr, this);
     }
 
+    if (err != 0){
+        errMsg("create connection thread failed");
+        m_state = CS_STOPPED;
+        return;
+    }
+    m_isrunning = true;
+}
+
+//true on a thread of the connection, it cannot join the connection thread
+bool DataTransmit::isownthread()
+{
+    pthread_t self = pthread_self();
+
+    return pthread_equal(self, m_isserver ? m_ptd_lsnclt : m_ptd_connsvr) || pthread_equal(self, m_ptd_recv) ||
+           pthread_equal(self, m_ptd_send) || pthread_equal(self, m_ptd_shm);
 }
 
+//wake up every thread and join them, the connection can be initialized again afterwards
+//calling it from the callback function only signals the threads, they exit by themselves
+//and the next InitialConnection joins them
 void DataTransmit::StopConnection()
 {
-    m_isconnect = false;
-    m_isterminate = true;
-    shutdown(m_conn_sock, 2);
-    close(m_conn_sock);
+    void *tret;
+
+    if (!m_isrunning)
+        return;
+
+    m_state = CS_STOPPING;
+    eventfd_write(m_stopfd, 1);
+    if (isownthread())
+        return;
+
+    pthread_join(m_isserver ? m_ptd_lsnclt : m_ptd_connsvr, &tret);
+    m_isrunning = false;
+    m_state = CS_STOPPED;
 }
 
 void DataTransmit::SetCallbackfunction(callback_t func)
@@ -298,6 +788,42 @@ void DataTransmit::SetCallbackfunction(callback_t func)
     m_callbackfunc = func;
 }
 
+void DataTransmit::SetRpcHandler(rpchook_t func, void *ctx)
+{
+    m_rpcctx = ctx;
+    m_rpcfunc = func;
+}
+
+void DataTransmit::SetCapture(Capture *cap)
+{
+    m_capture = cap;
+}
+
+void DataTransmit::SetTracing(bool set)
+{
+    m_istrace = set;
+}
+
+Tracer *DataTransmit::GetTracer()
+{
+    return &m_tracer;
+}
+
+//hand a received message to the capture and the callback function, one with a rpc head to the rpc handler
+void DataTransmit::deliver(char *buf, int len, const unsigned char *rpc, int rpclen)
+{
+    if (m_capture != NULL)
+        m_capture->Record(m_connid, CAPTURE_RECV, buf, len);
+    if (rpclen >= 0){
+        //without its head the payload means nothing to the callback function
+        if (m_rpcfunc != NULL)
+            m_rpcfunc(m_rpcctx, rpc, rpclen, buf, len);
+        return;
+    }
+    if (m_callbackfunc != NULL)
+        m_callbackfunc(buf, len);
+}
+
 void DataTransmit::SetUseUdp(bool set)
 {
     m_isudp = set;
@@ -315,256 +841,1231 @@ void DataTransmit::SetSimplify(bool set)
     m_isheartbeat = !set;
 }
 
-int DataTransmit::SendData(char *buf, int len)
+void DataTransmit::SetMulticast(const char *group, const char *ifaddr)
 {
-    if (!m_isconnect)
-        return -1;
+    struct in_addr addr;
 
-    if (m_issimplify)
-        return senddatasimplify(buf, len);
-    else
-        return senddatanormaly(buf, len);
+    if (inet_aton(group, &addr) == 0 || !IN_MULTICAST(ntohl(addr.s_addr))){
+        errMsg("%s is not a multicast group", group);
+        return;
+    }
+    m_mcastgroup = addr;
+    m_mcastif.s_addr = ifaddr ? inet_addr(ifaddr) : htonl(INADDR_ANY);
+    m_ismulticast = true;
+    if (!m_isserver)
+        m_addr = addr;
+    SetUseUdp(true);
 }
 
-int DataTransmit::senddatanormaly(char *buf, int len)
+void DataTransmit::SetDedup(bool set)
 {
-    int sendbytes;
-    int leftbytes;
-    int totalbytes;
-    socklen_t addrlen;
-    char *outbuf;
-    //Send block head
-    BH bh;
-    memcpy(bh.sign, m_sign, 8);
-    bh.blen = len;
-    bh.chksum = crc32(0xffffffff, (unsigned char*)buf, len);
-    bh.flag = 0;
-    addrlen = sizeof(struct sockaddr_in);
-
-    if (m_isudp)
-        sendbytes = sendto(m_conn_sock, &bh, sizeof(bh), 0, (struct sockaddr*)&m_udpaddr, addrlen);
-    else
-        sendbytes = send(m_conn_sock, &bh, sizeof(bh), 0);
+    m_isdedup = set;
+}
 
-    if ((unsigned int)sendbytes < sizeof(bh)){
-        m_isconnect = false;
-        errMsg("send block head failed, %d bytes", sizeof(bh));
-        return -1;
-    }
+void DataTransmit::SetNonBlocking(bool set)
+{
+    m_isnonblock = set;
+}
 
-    leftbytes = len;
-    totalbytes = 0;
-    sendbytes = 0;
-    //crypt
-    outbuf = (char *)malloc(MAX_DATA_LEN);
-    P_RC4(m_key, (unsigned char*)buf, (unsigned char*)outbuf, len);
-    if (m_isconnect){
-        while (sendbytes < leftbytes){
-            leftbytes = len - totalbytes;
-            if (m_isudp)
-                sendbytes = sendto(m_conn_sock, outbuf+totalbytes, leftbytes, 0, (struct sockaddr*)&m_udpaddr, addrlen);
-            else
-                sendbytes = send(m_conn_sock, outbuf+totalbytes, leftbytes, 0);
-
-            if (sendbytes < 0){
-                m_isconnect = false;
-                free(outbuf);
-                perror("send");
-                errMsg("send data failed, %d bytes", leftbytes);
-                return -1;
-            }
-            totalbytes += sendbytes;
-        }
+void DataTransmit::SetSendBuffer(int limit, int highmark, int lowmark)
+{
+    if (limit <= 0 || highmark > limit || lowmark > highmark || lowmark < 0){
+        errMsg("invalid send buffer %d(%d/%d)", limit, highmark, lowmark);
+        return;
     }
-    free(outbuf);
-    return len;
+    pthread_mutex_lock(&m_optsmtx);
+    m_nextopts.sendlimit = limit;
+    m_nextopts.highmark = highmark;
+    m_nextopts.lowmark = lowmark;
+    m_isoptschanged = true;
+    pthread_mutex_unlock(&m_optsmtx);
 }
 
-int DataTransmit::senddatasimplify(char *buf, int len)
+void DataTransmit::SetPacing(int rate, int burst, bool fq)
 {
-    int sendbytes;
-    int leftbytes;
-    int totalbytes;
-    socklen_t addrlen;
+    bool wasfq;
 
-    addrlen = sizeof(struct sockaddr_in);
-
-    leftbytes = len;
-    totalbytes = 0;
-    sendbytes = 0;
+    if (rate < 0 || (rate > 0 && burst <= 0)){
+        errMsg("invalid pacing %d(%d)", rate, burst);
+        return;
+    }
+    pthread_mutex_lock(&m_optsmtx);
+    wasfq = m_nextopts.pacingfq != 0;
+    m_nextopts.pacingrate = rate;
+    m_nextopts.pacingburst = burst;
+    m_nextopts.pacingfq = fq ? 1 : 0;
+    m_isoptschanged = true;
+    pthread_mutex_unlock(&m_optsmtx);
+    m_pacer.Set(rate, burst);
+    //a send waiting on the old rate takes its bytes again
+    wakepacers();
+    //the live socket follows right away, new ones get it from the options,
+    //m_writemtx keeps the socket from being closed under it
+    if (!fq && !wasfq)
+        return;
+    pthread_mutex_lock(&m_writemtx);
+    if (m_conn_sock >= 0)
+        NetCore::max_pacing(m_conn_sock, fq ? rate : 0);
+    pthread_mutex_unlock(&m_writemtx);
+}
 
-    if (m_isconnect){
-        while (sendbytes < leftbytes){
-            leftbytes = len - totalbytes;
-            if (m_isudp)
-                sendbytes = sendto(m_conn_sock, buf+totalbytes, leftbytes, 0, (struct sockaddr*)&m_udpaddr, addrlen);
-            else
-                sendbytes = send(m_conn_sock, buf+totalbytes, leftbytes, 0);
+void DataTransmit::SetGlobalPacing(int rate, int burst)
+{
+    globalpacer()->Set(rate, burst);
+    wakepacers();
+}
 
-            if (sendbytes < 0){
-                m_isconnect = false;
-                perror("send");
-                errMsg("send data failed, %d bytes", leftbytes);
-                return -1;
-            }
-            totalbytes += sendbytes;
-        }
+void DataTransmit::SetTransportOptions(const TRANSPORT_OPTS *opts)
+{
+    if (!NetCore::check_options(opts)){
+        errMsg("invalid transport options");
+        return;
     }
+    pthread_mutex_lock(&m_optsmtx);
+    m_nextopts = *opts;
+    m_isoptschanged = true;
+    pthread_mutex_unlock(&m_optsmtx);
+}
 
-    return len;
+//the options the next link starts with
+TRANSPORT_OPTS DataTransmit::GetTransportOptions()
+{
+    TRANSPORT_OPTS opts;
+
+    pthread_mutex_lock(&m_optsmtx);
+    opts = m_nextopts;
+    pthread_mutex_unlock(&m_optsmtx);
+    return opts;
 }
 
-int DataTransmit::RecvData(char *buf, int len)
+//options set since the last link take effect while no link thread reads them,
+//return true if they changed
+bool DataTransmit::applyoptions()
 {
-    int recvbytes;
-    recvbytes = 0;
-    if (m_isconnect){
-        recvbytes = recv(m_conn_sock, buf, len, 0);
-        if (recvbytes < 0){
-            errMsg("recv data failed");
-        }
-    }
-    return recvbytes;
+    bool changed;
+
+    pthread_mutex_lock(&m_optsmtx);
+    changed = m_isoptschanged;
+    if (changed)
+        m_nc.set_options(&m_nextopts);
+    m_isoptschanged = false;
+    pthread_mutex_unlock(&m_optsmtx);
+    if (changed)
+        m_pacer.Set(m_nc.get_options().pacingrate, m_nc.get_options().pacingburst);
+    return changed;
 }
 
-int DataTransmit::GetConnectionStatus()
+void DataTransmit::SetWatermarkCallback(notify_t high, notify_t low)
 {
-    return m_isconnect;
+    m_highfunc = high;
+    m_lowfunc = low;
 }
 
-int DataTransmit::GetConnectionPort()
+void DataTransmit::SetWritableCallback(notify_t func)
 {
-    if (m_isserver)
-        return m_localport;
-    else
-        return m_svrport;
+    m_writablefunc = func;
 }
 
-HOST_INFO DataTransmit::GetRemoteHostInfo()
+int DataTransmit::SendData(char *buf, int len)
 {
-    return m_remote;
+    return sendmsg(buf, len, false);
 }
 
-void *DataTransmit::listen_clt(void *param)
+int DataTransmit::TrySend(char *buf, int len)
 {
-    DataTransmit *dt = (DataTransmit *)param;
-    int sockfd;
-    struct in_addr addr;
-    if (dt->m_islocalip)
-        addr.s_addr = inet_addr(dt->m_localip);
+    return sendmsg(buf, len, true);
+}
 
-    sockfd = dt->m_nc.socket_new_listen(SOCK_STREAM, dt->m_localport, dt->m_islocalip?&addr:NULL);
+int DataTransmit::SendRpc(const char *head, int headlen, char *buf, int len, bool nowait)
+{
+    unsigned char opt[2 + FO_RPC_MAX];
 
-    int acc_time = ACCEPT_TIME;
-    void *tret;
-    if (sockfd < 0){
-        dt->errMsg("listen on %d failed", dt->m_localport);
-        return NULL;
-    }
+    if (headlen <= 0 || headlen > FO_RPC_MAX)
+        return -1;
+    opt[0] = FO_RPC;
+    opt[1] = (unsigned char)headlen;
+    memcpy(opt + 2, head, headlen);
+    return sendmsg(buf, len, nowait, opt);
+}
 
-    while (!dt->m_isterminate){
-        dt->errMsg("listening on %d...", dt->m_localport);
-        dt->m_conn_sock = dt->m_nc.socket_accept(sockfd, ACCEPT_TIMEOUT, &dt->m_remote);
-        if (dt->m_conn_sock > 0){
-            dt->errMsg("get a connection from %s(%d)", dt->m_remote.szip, dt->m_remote.port);
-            dt->m_isconnect = true;
-            if (dt->m_issimplify)
-                pthread_create(&dt->m_ptd_recv, NULL, dt->recv_data_simplify, dt);
-            else
-                pthread_create(&dt->m_ptd_recv, NULL, dt->recv_data, dt);
-            if (dt->m_isheartbeat)
-                pthread_create(&dt->m_ptd_heartbeat, NULL, dt->heart_beat, dt);
-            pthread_join(dt->m_ptd_recv, &tret);
-        }
-        if (acc_time != -1){
-            acc_time--;
-            if (acc_time <= 0)
-                break;
-        }
+//checks, capture and tracing around the send function selectTransport picked for the link
+//opt is a FO_RPC option, only links that agreed on CT_RPC take it
+int DataTransmit::sendmsg(char *buf, int len, bool nowait, const unsigned char *opt)
+{
+    uint64_t entry;
+    int ret;
+
+    if (!isConnected())
+        return -1;
+    if (len > m_nc.get_options().maxdatalen){
+        errMsg("data too long, %d bytes", len);
+        return -1;
     }
 
-    return NULL;
+    entry = m_istrace ? Tracer::now() : 0;
+    ret = (this->*m_sendfunc)(buf, len, nowait, entry, opt);
+    if (ret >= 0 && m_capture != NULL)
+        m_capture->Record(m_connid, CAPTURE_SEND, buf, len);
+    if (ret >= 0 && m_istrace)
+        m_tracer.Add(TS_CALL, entry, Tracer::now());
+    return ret;
 }
 
-void *DataTransmit::udp_clt(void *param)
+//write one message with transport T, nowait only matters once data goes through shared memory
+//m_isshmsend is checked under m_writemtx, the switch frame is the last one written to the socket
+template<class T>
+int DataTransmit::writemessage(char *buf, int len, bool nowait, uint64_t entry, const unsigned char *opt)
 {
-    DataTransmit *dt = (DataTransmit *)param;
-    int sockfd, ret;
-    socklen_t len;
-    char *buf;
-    char *outbuf;
-    BH bh;
-    struct sockaddr_in addr;
+    int ret, paced;
+
+    //paced before m_writemtx so other senders and control frames are not held up, the frame
+    //is not encoded yet and the longest header is taken, sendmessage settles the difference
+    paced = 0;
+    if (!m_isshmsend){
+        paced = T::framing_type::framed ? len + FRAME_MAX_HEAD : len;
+        pace(paced);
+    }
+    pthread_mutex_lock(&m_writemtx);
+    if (opt != NULL && !m_isrpc){
+        pthread_mutex_unlock(&m_writemtx);
+        unpace(paced);
+        return -1;
+    }
+    if (m_isshmsend){
+        pthread_mutex_unlock(&m_writemtx);
+        unpace(paced);
+        return sendshm(buf, len, nowait);
+    }
+    m_tracesend = entry;
+    m_sendopt = opt;
+    ret = sendmessage<T>(buf, len, paced);
+    m_sendopt = NULL;
+    pthread_mutex_unlock(&m_writemtx);
+    return ret;
+}
 
-    sockfd = dt->m_nc.socket_new(SOCK_DGRAM);
-    if (sockfd < 0)
-        return NULL;
+//encode one message with transport T for the send thread, never waits for room
+template<class T>
+int DataTransmit::queuemessage(char *buf, int len, bool, uint64_t entry, const unsigned char *opt)
+{
+    int ret;
 
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(dt->m_localport);
-    if (dt->m_islocalip)
-        addr.sin_addr.s_addr = inet_addr(dt->m_localip);
+    pthread_mutex_lock(&m_writemtx);
+    if (opt != NULL && !m_isrpc){
+        pthread_mutex_unlock(&m_writemtx);
+        return -1;
+    }
+    if (m_isshmsend){
+        pthread_mutex_unlock(&m_writemtx);
+        return sendshm(buf, len, true);
+    }
+    m_tracesend = entry;
+    m_sendopt = opt;
+    ret = queueblock<T>(buf, len, false);
+    m_sendopt = NULL;
+    pthread_mutex_unlock(&m_writemtx);
+    //an empty message is a frame too
+    if (ret >= 0)
+        eventfd_write(m_sendfd, 1);
+    notifyhigh();
+    return ret;
+}
+
+//frames[0] raw, frames[1] v1, frames[2] v2 and frames[3] v2 with a trace stamp, each is encoded
+//by the first member that needs it, so members only carry stamps when they trace themselves,
+//and the stamps are those of the first tracing member
+int DataTransmit::SendToGroup(DataTransmit **group, int count, char *buf, int len)
+{
+    PSF frames[GROUP_FRAMES];
+    int i, sent;
+
+    memset(frames, 0, sizeof(frames));
+    sent = 0;
+    for (i=0; i<count; i++){
+        if (group[i] == NULL)
+            continue;
+        if (group[i]->trysendshared(buf, len, frames) >= 0)
+            sent++;
+    }
+    for (i=0; i<GROUP_FRAMES; i++){
+        if (frames[i])
+            releaseshared(frames[i]);
+    }
+    return sent;
+}
+
+//TrySend with a frame shared by the group, a member without a send queue takes nothing
+int DataTransmit::trysendshared(char *buf, int len, PSF *frames)
+{
+    uint64_t entry;
+    int ret;
+
+    if (!isConnected())
+        return -1;
+    if (m_groupfunc == NULL){
+        errMsg("group members must be non-blocking tcp connections");
+        return -1;
+    }
+    if (len > m_nc.get_options().maxdatalen){
+        errMsg("data too long, %d bytes", len);
+        return -1;
+    }
+
+    entry = m_istrace ? Tracer::now() : 0;
+    ret = (this->*m_groupfunc)(buf, len, frames, entry);
+    if (ret >= 0 && m_capture != NULL)
+        m_capture->Record(m_connid, CAPTURE_SEND, buf, len);
+    if (ret >= 0 && m_istrace)
+        m_tracer.Add(TS_CALL, entry, Tracer::now());
+    return ret;
+}
+
+//queue the group frame of this link's wire format version, encoded with transport T if nobody did yet
+template<class T>
+int DataTransmit::queuegroup(char *buf, int len, PSF *frames, uint64_t entry)
+{
+    int ret, ver, slot;
+
+    pthread_mutex_lock(&m_writemtx);
+    if (m_isshmsend){
+        pthread_mutex_unlock(&m_writemtx);
+        return sendshm(buf, len, true);
+    }
+    m_tracesend = entry;
+    m_sendopt = NULL;
+    //the wire format version only changes under m_writemtx
+    ver = T::framing_type::framed ? m_wirever.load() : 0;
+    slot = ver >= 2 && entry != 0 ? GROUP_FRAMES - 1 : ver;
+    if (frames[slot] == NULL)
+        frames[slot] = newshared<T>(buf, len, ver);
+    ret = queueshared(frames[slot], len);
+    pthread_mutex_unlock(&m_writemtx);
+    if (ret >= 0)
+        eventfd_write(m_sendfd, 1);
+    notifyhigh();
+    return ret;
+}
+
+//the caller owns the first reference
+template<class T>
+PSF DataTransmit::newshared(const char *buf, int len, int ver)
+{
+    PSF sf;
+
+    sf = (PSF)malloc(sizeof(SF) + len + FRAME_MAX_HEAD);
+    sf->refs = 1;
+    m_traceenc = 0;
+    sf->len = encodeframe<T>(sf->data, FK_DATA, buf, len, ver);
+    sf->stamp = m_traceenc;
+    return sf;
+}
+
+void DataTransmit::releaseshared(PSF sf)
+{
+    if (__atomic_sub_fetch(&sf->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(sf);
+}
+
+void DataTransmit::freeblock(PSB sb)
+{
+    if (sb->shared)
+        releaseshared(sb->shared);
+    free(sb);
+}
+
+int DataTransmit::GetSendBuffered()
+{
+    int buffered;
+
+    pthread_mutex_lock(&m_sendmtx);
+    buffered = m_sendbuffered;
+    pthread_mutex_unlock(&m_sendmtx);
+    return buffered;
+}
+
+//encode one message with transport T into a block and append it to the outbound buffer
+template<class T>
+int DataTransmit::queueblock(char *buf, int len, bool force)
+{
+    PSB sb;
+    int blen;
+
+    //reserve the longest header, the difference is given back once encoded
+    blen = T::framing_type::framed ? framebound(len) : len;
+    if (!reserveblock(blen, force))
+        return SEND_WOULDBLOCK;
+    sb = newblock(blen);
+    m_traceenc = 0;
+    sb->len = encodeframe<T>(sb->data, FK_DATA, buf, len, 0, true);
+    sb->stamp = m_traceenc;
+    appendblock(sb, blen);
+    return len;
+}
+
+//append a frame encoded by the caller, control and heart beat frames are never rejected
+int DataTransmit::queueframe(const char *frame, int len)
+{
+    PSB sb;
+
+    reserveblock(len, true);
+    sb = newblock(len);
+    memcpy(sb->data, frame, len);
+    sb->len = len;
+    appendblock(sb, len);
+    return len;
+}
+
+//append a frame shared with other connections, only the block is allocated, return len
+int DataTransmit::queueshared(PSF sf, int len)
+{
+    PSB sb;
+
+    if (!reserveblock(sf->len, false))
+        return SEND_WOULDBLOCK;
+    __atomic_add_fetch(&sf->refs, 1, __ATOMIC_RELAXED);
+    sb = newblock(0);
+    sb->shared = sf;
+    sb->len = sf->len;
+    sb->stamp = sf->stamp;
+    appendblock(sb, sf->len);
+    return len;
+}
+
+//count blen bytes into the outbound buffer, false if they do not fit and force is not set
+bool DataTransmit::reserveblock(int blen, bool force)
+{
+    pthread_mutex_lock(&m_sendmtx);
+    //a single message larger than the limit is still accepted by an empty buffer
+    if (!force && m_sendbuffered > 0 && m_sendbuffered + blen > m_nc.get_options().sendlimit){
+        m_iswouldblock = true;
+        pthread_mutex_unlock(&m_sendmtx);
+        return false;
+    }
+    m_sendbuffered += blen;
+    if (!m_isabovehigh && m_sendbuffered >= m_nc.get_options().highmark){
+        m_isabovehigh = true;
+        m_highpending = m_sendbuffered;
+    }
+    pthread_mutex_unlock(&m_sendmtx);
+    return true;
+}
+
+//link a block at the tail, the part of reserved it does not use is given back
+void DataTransmit::appendblock(PSB sb, int reserved)
+{
+    pthread_mutex_lock(&m_sendmtx);
+    m_sendbuffered -= reserved - sb->len;
+    if (m_sendtail)
+        m_sendtail->next = sb;
     else
-        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        m_sendhead = sb;
+    m_sendtail = sb;
+    pthread_mutex_unlock(&m_sendmtx);
+}
 
-    ret = bind(sockfd, (struct sockaddr *)&addr, sizeof(addr));
-    if (ret < 0){
-        close(sockfd);
-        return NULL;
+PSB DataTransmit::newblock(int size)
+{
+    PSB sb;
+
+    sb = (PSB)malloc(sizeof(SB) + size);
+    sb->next = NULL;
+    sb->shared = NULL;
+    sb->len = 0;
+    sb->off = 0;
+    sb->paced = false;
+    sb->stamp = 0;
+    return sb;
+}
+
+//the high watermark crossed by a queueing call, reported once the caller released m_writemtx
+void DataTransmit::notifyhigh()
+{
+    int buffered;
+
+    pthread_mutex_lock(&m_sendmtx);
+    buffered = m_highpending;
+    m_highpending = -1;
+    pthread_mutex_unlock(&m_sendmtx);
+    if (buffered >= 0 && m_highfunc != NULL)
+        m_highfunc(buffered);
+}
+
+//send queued blocks until the buffer is empty or the socket would block
+//return 0 empty, 1 would block, -1 error
+int DataTransmit::flushblocks()
+{
+    PSB sb;
+    int ret, buffered;
+    bool done, low, writable;
+
+    while (true){
+        pthread_mutex_lock(&m_sendmtx);
+        sb = m_sendhead;
+        pthread_mutex_unlock(&m_sendmtx);
+        if (sb == NULL)
+            return 0;
+
+        //a block partly written by an earlier call has its tokens already
+        if (!sb->paced){
+            sb->paced = true;
+            pace(sb->len);
+        }
+        ret = send(m_conn_sock, (sb->shared ? sb->shared->data : sb->data)+sb->off, sb->len-sb->off,
+                   MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (ret < 0){
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            perror("send");
+            return -1;
+        }
+        sb->off += ret;
+        done = sb->off == sb->len;
+
+        low = writable = false;
+        pthread_mutex_lock(&m_sendmtx);
+        m_sendbuffered -= ret;
+        if (done){
+            m_sendhead = sb->next;
+            if (m_sendhead == NULL)
+                m_sendtail = NULL;
+        }
+        if (m_isabovehigh && m_sendbuffered <= m_nc.get_options().lowmark){
+            m_isabovehigh = false;
+            low = true;
+        }
+        if (m_iswouldblock && m_sendbuffered <= m_nc.get_options().lowmark){
+            m_iswouldblock = false;
+            writable = true;
+        }
+        buffered = m_sendbuffered;
+        pthread_mutex_unlock(&m_sendmtx);
+
+        if (done && sb->stamp != 0)
+            m_tracer.Add(TS_WRITE, sb->stamp, Tracer::now());
+        if (done)
+            freeblock(sb);
+        if (low && m_lowfunc != NULL)
+            m_lowfunc(buffered);
+        if (writable && m_writablefunc != NULL)
+            m_writablefunc(buffered);
     }
+}
 
-    buf = (char *)malloc(MAX_DATA_LEN);
-    outbuf = (char *)malloc(MAX_DATA_LEN);
-    memset(&bh, 0, sizeof(BH));
-    memset(buf, 0, MAX_DATA_LEN);
-    memset(outbuf, 0, MAX_DATA_LEN);
+//encode one frame with transport T in wire format ver, 0 means the negotiated one, return its length
+//out must have room for len + FRAME_MAX_HEAD bytes, framebound(len) with dedup
+template<class T>
+int DataTransmit::encodeframe(char *out, int kind, const char *buf, int len, int ver, bool dedup)
+{
+    if (ver == 0)
+        ver = m_wirever;
+    if (kind == FK_DATA)
+        return encodedata<T>(out, buf, len, ver, dedup);
+    return T::frame(out, kind, buf, len, ver, m_sign);
+}
 
-    dt->m_conn_sock = sockfd;
-    dt->errMsg("listening on %d(udp)...", dt->m_localport);
+//room for one encoded data frame of len bytes
+int DataTransmit::framebound(int len)
+{
+    return (m_isdedup ? Dedup::Bound(len) : len) + FRAME_MAX_HEAD;
+}
 
-    while(!dt->m_isterminate){
-        len = sizeof(addr);
-        ret = recvfrom(sockfd, buf, MAX_DATA_LEN, MSG_DONTWAIT, (struct sockaddr*)&addr, &len);
-        if (ret < 0)
-            continue;
-        memcpy(&dt->m_udpaddr, &addr, sizeof(addr));
-        dt->errMsg("recv %d bytes from %s", ret, inet_ntoa(addr.sin_addr));
-        dt->m_isconnect = true;
-        if (ret == 0){
-            dt->m_isconnect = false;
-            close(sockfd);
+//encode a data frame with transport T, stamped with FO_TRACE when tracing
+//with dedup a large message is replaced by its chunk recipe once CT_DEDUP is agreed
+template<class T>
+int DataTransmit::encodedata(char *out, const char *buf, int len, int ver, bool dedup)
+{
+    unsigned char opts[FO_TRACE_LEN + 2 + 2 + FO_RPC_MAX];
+    int n, optlen;
+    bool trace, rpc;
+
+    if (!T::framing_type::framed)
+        return T::encode(out, buf, len, ver, m_sign, m_key);
+    //a recipe the peer could not receive is not worth trying
+    dedup = dedup && ver >= 2 && len >= DEDUP_MIN_LEN && m_dedup.IsSending() &&
+            Dedup::Bound(len) <= m_nc.get_options().maxrecvlen;
+    trace = m_istrace && m_tracesend != 0 && ver >= 2;
+    rpc = m_sendopt != NULL && ver >= 2;
+    if (dedup)
+        len = m_dedup.Encode(buf, len, &buf);
+    if (!trace && !dedup && !rpc)
+        return T::encode(out, buf, len, ver, m_sign, m_key);
+    optlen = 0;
+    if (trace)
+        optlen += WireFormat::put_trace(opts, m_tracesend, 0);
+    if (dedup){
+        opts[optlen++] = FO_DEDUP;
+        opts[optlen++] = 0;
+    }
+    if (rpc){
+        memcpy(opts + optlen, m_sendopt, 2 + m_sendopt[1]);
+        optlen += 2 + m_sendopt[1];
+    }
+    n = T::encode(out, buf, len, ver, m_sign, m_key, opts, optlen);
+    if (!trace)
+        return n;
+    //the encode done stamp replaces a placeholder of the same length
+    m_traceenc = Tracer::now();
+    WireFormat::put_trace(opts, m_tracesend, m_traceenc);
+    WireFormat::update_opts((unsigned char*)out, n, opts, optlen);
+    m_tracer.Add(TS_ENCODE, m_tracesend, m_traceenc);
+    return n;
+}
+
+//handle one checked frame from the link, plain is its deciphered payload
+void DataTransmit::onframe(const FRAME_INFO *fi, char *plain)
+{
+    uint64_t sendts, encts, decoded, start;
+    const unsigned char *val, *rpc;
+    const char *msg;
+    int len, rpclen;
+
+    switch (fi->kind){
+    case FK_DATA:
+        len = fi->len;
+        rpclen = WireFormat::find_opt(fi, FO_RPC, &rpc);
+        if (WireFormat::find_opt(fi, FO_DEDUP, &val) >= 0){
+            len = m_dedup.Decode(plain, fi->len, m_nc.get_options().maxrecvlen, &msg);
+            if (len < 0){
+                //a new link starts both caches over
+                errMsg("dedup cache out of sync");
+                linkDown();
+                return;
+            }
+            plain = (char *)msg;
+        }
+        if (m_istrace && WireFormat::get_trace(fi, &sendts, &encts) == 0){
+            //the rx stamp is the one of the recv that completed the frame
+            decoded = Tracer::now();
+            m_tracer.Add(TS_WIRE, encts, m_rxts);
+            m_tracer.Add(TS_WAKEUP, m_rxts, m_recvts);
+            m_tracer.Add(TS_DECODE, m_recvts, decoded);
+            start = Tracer::now();
+            m_tracer.Add(TS_DISPATCH, decoded, start);
+            m_tracer.Add(TS_ONEWAY, sendts, start);
+            deliver(plain, len, rpc, rpclen);
+            m_tracer.Add(TS_CALLBACK, start, Tracer::now());
             break;
         }
-        if (ret == sizeof(BH) && memcmp(buf, dt->m_sign, 8) == 0){
-            if (bh.blen)
-                continue;
+        //callback function
+        deliver(plain, len, rpc, rpclen);
+        break;
+    case FK_CONTROL:
+        LinkControl<DataTransmit>::oncontrol(this, m_isserver, (unsigned char)plain[0], plain+1, fi->len-1);
+        break;
+    default:
+        //heart beat or ack
+        break;
+    }
+}
 
-            memcpy(&bh, buf, sizeof(bh));
-            ret = recv(dt->m_conn_sock, buf, bh.blen, 0);
-            dt->P_RC4(dt->m_key, (unsigned char*)buf, (unsigned char*)outbuf, bh.blen);
-            if (bh.chksum != (unsigned int)dt->crc32(0xffffffff, (unsigned char*)outbuf, ret)){
-                dt->errMsg("checksum error");
-            }else{
-                //callback function
-                if (dt->m_callbackfunc != NULL)
-                    dt->m_callbackfunc(outbuf, bh.blen);
+int DataTransmit::sendcontrol(int type, const char *data, int len, bool toshm, int newver)
+{
+    char payload[CONTROL_MAX_LEN];
+
+    if (len + 1 > CONTROL_MAX_LEN)
+        return -1;
+    payload[0] = (char)type;
+    if (len > 0)
+        memcpy(payload + 1, data, len);
+    return (this->*m_framefunc)(FK_CONTROL, payload, len + 1, toshm, newver);
+}
+
+//send a heart beat, ack or control frame with transport T, queued ones go out in order with the data
+//toshm: switch following data to shared memory right after this frame
+//newver: switch following frames to this wire format version
+template<class T, bool queued>
+int DataTransmit::sendframe(int kind, const char *buf, int len, bool toshm, int newver)
+{
+    char frame[CONTROL_MAX_LEN + FRAME_MAX_HEAD];
+    int ret, flen;
+
+    pthread_mutex_lock(&m_writemtx);
+    flen = encodeframe<T>(frame, kind, buf, len);
+    if (flen == 0){
+        //a raw transport has nothing but data
+        pthread_mutex_unlock(&m_writemtx);
+        return 0;
+    }
+    if (queued){
+        ret = queueframe(frame, flen);
+        eventfd_write(m_sendfd, 1);
+    }
+    else if (T::write(m_conn_sock, T::socket_type::datagram ? &m_udpaddr : NULL, frame, flen) < 0){
+        linkDown();
+        perror("send");
+        ret = -1;
+    }
+    else
+        ret = flen;
+    if (ret > 0 && toshm)
+        m_isshmsend = true;
+    if (ret > 0 && newver)
+        m_wirever = newver;
+    pthread_mutex_unlock(&m_writemtx);
+    if (queued)
+        notifyhigh();
+    return ret;
+}
+
+int DataTransmit::sendheartbeat()
+{
+    return (this->*m_framefunc)(FK_HEARTBEAT, NULL, 0, false, 0);
+}
+
+int DataTransmit::sendpending()
+{
+    return GetSendBuffered();
+}
+
+void DataTransmit::setversion(int ver)
+{
+    pthread_mutex_lock(&m_writemtx);
+    m_wirever = ver;
+    pthread_mutex_unlock(&m_writemtx);
+}
+
+//listener side, attach the connector's segment and answer with our maxdatalen
+bool DataTransmit::attachshm(char *data, int len)
+{
+    char name[SHM_NAME_LEN];
+    unsigned char maxlen[5];
+    struct in_addr addr;
+    int n;
+
+    n = strnlen(data, len);
+    if (n == 0 || n >= len || n >= SHM_NAME_LEN)
+        return false;
+    memcpy(name, data, n + 1);
+    addr.s_addr = inet_addr(m_remote.szip);
+    pthread_mutex_lock(&m_shmmtx);
+    if (!m_isserver || m_nc.get_options().shmsize <= 0 || !m_nc.is_local_addr(&addr) || m_shm.attach(name) != 0){
+        pthread_mutex_unlock(&m_shmmtx);
+        return false;
+    }
+    m_shm.unlink();
+    m_shm.set_spin(m_nc.get_options().shmspin);
+    pthread_mutex_unlock(&m_shmmtx);
+    errMsg("shared memory %s attached", name);
+    setshmpeermax(data + n + 1, len - n - 1);
+    sendcontrol(CT_SHM_ACCEPT, (char *)maxlen, WireFormat::put_varint(maxlen, m_nc.get_options().maxdatalen), true);
+    return true;
+}
+
+void DataTransmit::onshmaccept(char *data, int len)
+{
+    if (!m_shm.is_attached())
+        return;
+    m_shm.unlink();
+    setshmpeermax(data, len);
+    //listener data after ACCEPT is already in the ring
+    startshm();
+    sendcontrol(CT_SHM_SWITCH, NULL, 0, true);
+    errMsg("switch to shared memory");
+}
+
+void DataTransmit::onshmreject()
+{
+    pthread_mutex_lock(&m_shmmtx);
+    m_shm.detach();
+    pthread_mutex_unlock(&m_shmmtx);
+}
+
+void DataTransmit::onshmswitch()
+{
+    if (m_shm.is_attached())
+        startshm();
+}
+
+//connector side, ask the listener for dedup with our chunk cache size
+void DataTransmit::offerdedup()
+{
+    unsigned char size[5];
+
+    if (!m_isdedup || m_isudp || m_issimplify || m_nc.get_options().dedupcache <= 0)
+        return;
+    sendcontrol(CT_DEDUP, (char *)size, WireFormat::put_varint(size, m_nc.get_options().dedupcache));
+}
+
+//both ends use the smaller cache, a listener without dedup does not answer
+void DataTransmit::ondedup(char *data, int len)
+{
+    unsigned char size[5];
+    unsigned int val;
+
+    if (WireFormat::get_varint((const unsigned char *)data, len, &val) <= 0 || val == 0)
+        return;
+    if (m_isserver){
+        if (!m_isdedup || m_nc.get_options().dedupcache <= 0)
+            return;
+        if (val > (unsigned int)m_nc.get_options().dedupcache)
+            val = m_nc.get_options().dedupcache;
+        //recipes may follow the answer right away
+        m_dedup.StartRecv(val);
+        if (sendcontrol(CT_DEDUP, (char *)size, WireFormat::put_varint(size, val)) <= 0)
+            return;
+    }
+    else
+        m_dedup.StartRecv(val);
+    pthread_mutex_lock(&m_writemtx);
+    m_dedup.StartSend(val);
+    pthread_mutex_unlock(&m_writemtx);
+    errMsg("dedup with %u bytes chunk cache", val);
+}
+
+//connector side, tell the listener rpc heads may come as FO_RPC
+void DataTransmit::offerrpc()
+{
+    if (m_rpcfunc == NULL || m_isudp || m_issimplify)
+        return;
+    sendcontrol(CT_RPC, NULL, 0);
+}
+
+//a listener with a rpc handler answers, then both ends may send FO_RPC
+void DataTransmit::onrpc()
+{
+    //v1 frames have no options
+    if (m_rpcfunc == NULL || m_wirever < 2)
+        return;
+    if (m_isserver && sendcontrol(CT_RPC, NULL, 0) <= 0)
+        return;
+    pthread_mutex_lock(&m_writemtx);
+    m_isrpc = true;
+    pthread_mutex_unlock(&m_writemtx);
+    errMsg("rpc agreed");
+}
+
+//connector side, offer a shared memory segment when the listener is on this host
+//the ring carries bare messages, so not when rpc heads may have to go with them
+void DataTransmit::offershm()
+{
+    char offer[SHM_NAME_LEN + 5];
+    int ret, n;
+
+    if (m_isudp || m_issimplify || m_rpcfunc != NULL || m_nc.get_options().shmsize <= 0 ||
+        !m_nc.is_local_addr(&m_addr))
+        return;
+    pthread_mutex_lock(&m_shmmtx);
+    ret = m_shm.create(m_nc.get_options().shmsize);
+    if (ret == 0)
+        m_shm.set_spin(m_nc.get_options().shmspin);
+    pthread_mutex_unlock(&m_shmmtx);
+    if (ret < 0){
+        errMsg("create shared memory failed");
+        return;
+    }
+    //the listener refuses to send what this end would drop
+    n = strlen(m_shm.name()) + 1;
+    memcpy(offer, m_shm.name(), n);
+    n += WireFormat::put_varint((unsigned char *)offer + n, m_nc.get_options().maxdatalen);
+    sendcontrol(CT_SHM_OFFER, offer, n);
+}
+
+//the largest message the peer takes from the ring, before the switch frame goes out
+void DataTransmit::setshmpeermax(const char *data, int len)
+{
+    unsigned int val;
+
+    if (WireFormat::get_varint((const unsigned char *)data, len, &val) > 0 && (int)val > 0)
+        m_shmpeermax = (int)val;
+}
+
+void DataTransmit::startshm()
+{
+    if (m_isshmrecv)
+        return;
+    m_isshmrecv = pthread_create(&m_ptd_shm, NULL, shm_recv, this) == 0;
+}
+
+void DataTransmit::stopshm()
+{
+    void *tret;
+
+    m_isshmsend = false;
+    m_shm.wakeup();
+    if (m_isshmrecv)
+        pthread_join(m_ptd_shm, &tret);
+    m_isshmrecv = false;
+    m_ptd_shm = pthread_t();
+    pthread_mutex_lock(&m_shmmtx);
+    m_shm.detach();
+    pthread_mutex_unlock(&m_shmmtx);
+}
+
+int DataTransmit::sendshm(char *buf, int len, bool nowait)
+{
+    int ret;
+
+    //tcp would take the link down for it, the ring has no frame to refuse
+    if (m_shmpeermax > 0 && len > m_shmpeermax){
+        errMsg("data too long for the peer, %d bytes", len);
+        return -1;
+    }
+    pthread_mutex_lock(&m_shmmtx);
+    ret = m_shm.write(buf, len, nowait);
+    pthread_mutex_unlock(&m_shmmtx);
+    if (ret == -2)
+        return SEND_WOULDBLOCK;
+    return ret;
+}
+
+void DataTransmit::clearblocks()
+{
+    PSB sb;
+
+    pthread_mutex_lock(&m_sendmtx);
+    while (m_sendhead){
+        sb = m_sendhead;
+        m_sendhead = sb->next;
+        m_sendbuffered -= sb->len - sb->off;
+        freeblock(sb);
+    }
+    m_sendtail = NULL;
+    m_isabovehigh = false;
+    m_iswouldblock = false;
+    m_highpending = -1;
+    pthread_mutex_unlock(&m_sendmtx);
+}
+
+//paced: bytes taken from the pacing buckets for this message
+template<class T>
+int DataTransmit::sendmessage(char *buf, int len, int paced)
+{
+    const struct sockaddr_in *to;
+    char *outbuf;
+    int ret, flen;
+    BH bh;
+
+    to = T::socket_type::datagram ? &m_udpaddr : NULL;
+    if (!T::framing_type::framed){
+        unpace(paced - len);
+        ret = T::write(m_conn_sock, to, buf, len);
+    }
+    else if (T::socket_type::datagram){
+        //v1 over udp, block head and payload are two datagrams
+        outbuf = (char *)malloc(len + FRAME_MAX_HEAD);
+        flen = T::encode(outbuf, buf, len, 1, m_sign, m_key);
+        memcpy(&bh, outbuf, sizeof(bh));
+        unpace(paced - flen);
+        ret = T::write(m_conn_sock, to, (char *)&bh, sizeof(bh));
+        if (ret >= 0)
+            ret = T::write(m_conn_sock, to, outbuf + sizeof(bh), flen - sizeof(bh));
+        free(outbuf);
+    }
+    else{
+        outbuf = (char *)malloc(framebound(len));
+        m_traceenc = 0;
+        flen = encodedata<T>(outbuf, buf, len, m_wirever, true);
+        unpace(paced - flen);
+        ret = T::write(m_conn_sock, to, outbuf, flen);
+        free(outbuf);
+        if (ret >= 0 && m_traceenc != 0)
+            m_tracer.Add(TS_WRITE, m_traceenc, Tracer::now());
+    }
+    if (ret < 0){
+        linkDown();
+        perror("send");
+        errMsg("send data failed, %d bytes", len);
+        return -1;
+    }
+    return len;
+}
+
+//one v2 datagram per message, encoded once for every subscriber of the group
+//m_writemtx also orders the sequence numbers
+int DataTransmit::senddatamulticast(char *buf, int len, bool, uint64_t, const unsigned char *)
+{
+    char out[MCAST_MAX_DATAGRAM];
+    unsigned char opts[8];
+    int n, ret, paced;
+
+    if (len > MCAST_MAX_DATAGRAM - FRAME_MAX_HEAD){
+        errMsg("data too long for a datagram, %d bytes", len);
+        return -1;
+    }
+    //paced before m_writemtx like writemessage
+    paced = len + FRAME_MAX_HEAD;
+    pace(paced);
+    pthread_mutex_lock(&m_writemtx);
+    opts[0] = FO_SEQ;
+    opts[1] = (unsigned char)WireFormat::put_varint(opts+2, ++m_mcastseq);
+    n = UdpTransport::encode(out, buf, len, FRAME_VERSION, m_sign, m_key, opts, 2 + opts[1]);
+    unpace(paced - n);
+    ret = UdpTransport::write(m_conn_sock, &m_udpaddr, out, n);
+    pthread_mutex_unlock(&m_writemtx);
+    if (ret < 0){
+        //a full queue only drops this message, subscribers see it as a gap
+        if (errno != ENOBUFS)
+            linkDown();
+        perror("sendto");
+        errMsg("send data failed, %d bytes", len);
+        return -1;
+    }
+    return len;
+}
+
+//one datagram from a multicast publisher, sequence gaps are counted as lost messages
+void DataTransmit::onmulticast(char *buf, int len, char *outbuf, const struct sockaddr_in *from)
+{
+    FRAME_INFO fi;
+    const unsigned char *val;
+    unsigned int seq;
+    uint64_t src;
+    std::map<uint64_t, unsigned int>::iterator it;
+    char *plain;
+    int ret;
+
+    ret = WireFormat::decode((unsigned char*)buf, len, m_sign, m_nc.get_options().maxdatalen, &fi);
+    if (ret != len || fi.kind != FK_DATA){
+        errMsg("bad multicast datagram, %d bytes", len);
+        return;
+    }
+    ret = WireFormat::find_opt(&fi, FO_SEQ, &val);
+    if (ret > 0 && WireFormat::get_varint(val, ret, &seq) > 0){
+        //every publisher numbers its own messages
+        src = (uint64_t)ntohl(from->sin_addr.s_addr) << 16 | ntohs(from->sin_port);
+        it = m_mcastlast.find(src);
+        if (it != m_mcastlast.end() && seq != 1){
+            //late datagrams are delivered but do not move the window back
+            if ((int)(seq - it->second) > 1){
+                m_mcastlost += seq - it->second - 1;
+                errMsg("multicast gap from %s:%d, %u messages lost", inet_ntoa(from->sin_addr),
+                       ntohs(from->sin_port), seq - it->second - 1);
             }
-        }else{
-            ret = recv(dt->m_conn_sock, buf, MAX_DATA_LEN, 0);
+            if ((int)(seq - it->second) > 0)
+                it->second = seq;
+        }
+        else{
+            //first datagram of a publisher, or it started over
+            if (it == m_mcastlast.end() && m_mcastlast.size() >= MCAST_MAX_SOURCES)
+                m_mcastlast.erase(m_mcastlast.begin());
+            m_mcastlast[src] = seq;
         }
     }
-    free(buf);
-    free(outbuf);
-    dt->errMsg("udp_clt thread terminate");
+    m_mcastrecv++;
+    plain = UdpTransport::check(&fi, buf + fi.hdrlen, outbuf, m_key);
+    if (plain == NULL){
+        errMsg("checksum error");
+        return;
+    }
+    onframe(&fi, plain);
+}
+
+int DataTransmit::RecvData(char *buf, int len)
+{
+    int recvbytes;
+    recvbytes = 0;
+    if (isConnected()){
+        recvbytes = recv(m_conn_sock, buf, len, 0);
+        if (recvbytes < 0){
+            errMsg("recv data failed");
+        }
+    }
+    return recvbytes;
+}
+
+int DataTransmit::GetConnectionStatus()
+{
+    return isConnected();
+}
+
+CONN_STATE DataTransmit::GetConnectionState()
+{
+    return (CONN_STATE)m_state.load();
+}
+
+int DataTransmit::GetSharedMemoryStatus()
+{
+    return m_isshmsend ? 1 : 0;
+}
+
+unsigned long DataTransmit::GetSharedMemoryDrops()
+{
+    return m_shm.dropped();
+}
+
+int DataTransmit::GetConnectionPort()
+{
+    if (m_isserver)
+        return m_localport;
+    else
+        return m_svrport;
+}
+
+HOST_INFO DataTransmit::GetRemoteHostInfo()
+{
+    return m_remote;
+}
+
+void DataTransmit::GetResyncStats(unsigned long *events, unsigned long *skipped)
+{
+    *events = m_resyncs;
+    *skipped = m_resyncbytes;
+}
+
+void DataTransmit::GetMulticastStats(unsigned long *received, unsigned long *lost)
+{
+    *received = m_mcastrecv;
+    *lost = m_mcastlost;
+}
+
+void DataTransmit::GetDedupStats(unsigned long *bytes, unsigned long *encoded)
+{
+    m_dedup.GetStats(bytes, encoded);
+}
+
+void DataTransmit::GetPacingStats(unsigned long *throttled, unsigned long *waited)
+{
+    m_pacer.GetStats(throttled, waited);
+}
+
+void DataTransmit::GetGlobalPacingStats(unsigned long *throttled, unsigned long *waited)
+{
+    globalpacer()->GetStats(throttled, waited);
+}
+
+//wait until both the connection and the process buckets let len wire bytes go, a rate change
+//while waiting takes them again from the new bucket, a stop or a link drop ends the wait early
+void DataTransmit::pace(int len)
+{
+    struct pollfd fds[3];
+    struct timespec ts;
+    unsigned long gen, ggen;
+    uint64_t t, until, guntil, deadline;
+    eventfd_t val;
+
+    t = TokenBucket::now();
+    until = t + m_pacer.Take(len, &gen) * 1000ULL;
+    guntil = t + globalpacer()->Take(len, &ggen) * 1000ULL;
+    if (until <= t && guntil <= t)
+        return;
+    //every wait has its own eventfd, so waits of several senders do not hold each other up,
+    //a rate change before it is registered is found by the generation check
+    fds[0].fd = m_stopfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = m_linkfd;
+    fds[1].events = POLLIN;
+    fds[2].fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    fds[2].events = POLLIN;
+    if (fds[2].fd >= 0){
+        pthread_mutex_lock(pacefdsmtx());
+        pacefds()->insert(fds[2].fd);
+        pthread_mutex_unlock(pacefdsmtx());
+    }
+    while (true){
+        t = TokenBucket::now();
+        if (m_pacer.GetGeneration() != gen)
+            until = t + m_pacer.Take(len, &gen, true) * 1000ULL;
+        if (globalpacer()->GetGeneration() != ggen)
+            guntil = t + globalpacer()->Take(len, &ggen, true) * 1000ULL;
+        deadline = until > guntil ? until : guntil;
+        if (deadline <= t)
+            break;
+        ts.tv_sec = (deadline - t) / 1000000000ULL;
+        ts.tv_nsec = (deadline - t) % 1000000000ULL;
+        //stopped, link down or the wait is over
+        if (ppoll(fds, 3, &ts, NULL) <= 0 || !(fds[2].revents & POLLIN))
+            break;
+        eventfd_read(fds[2].fd, &val);
+    }
+    if (fds[2].fd >= 0){
+        pthread_mutex_lock(pacefdsmtx());
+        pacefds()->erase(fds[2].fd);
+        pthread_mutex_unlock(pacefdsmtx());
+        close(fds[2].fd);
+    }
+}
+
+//wake every pacing wait to check the generation of its buckets
+void DataTransmit::wakepacers()
+{
+    std::set<int>::iterator it;
+
+    pthread_mutex_lock(pacefdsmtx());
+    for (it = pacefds()->begin(); it != pacefds()->end(); ++it)
+        eventfd_write(*it, 1);
+    pthread_mutex_unlock(pacefdsmtx());
+}
+
+//give back tokens pace took for bytes that were not sent, or take more without waiting when
+//the frame came out longer than paced, the next send waits them off
+void DataTransmit::unpace(int len)
+{
+    if (len == 0)
+        return;
+    m_pacer.Refund(len);
+    globalpacer()->Refund(len);
+}
+
+TokenBucket *DataTransmit::globalpacer()
+{
+    static TokenBucket pacer;
+    return &pacer;
+}
+
+pthread_mutex_t *DataTransmit::pacefdsmtx()
+{
+    static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+    return &mtx;
+}
+
+std::set<int> *DataTransmit::pacefds()
+{
+    static std::set<int> fds;
+    return &fds;
+}
+
+void *DataTransmit::listen_clt(void *param)
+{
+    DataTransmit *dt = (DataTransmit *)param;
+    int sockfd;
+    struct in_addr addr;
+    if (dt->m_islocalip)
+        addr.s_addr = inet_addr(dt->m_localip);
+
+    sockfd = dt->m_nc.socket_new_listen(SOCK_STREAM, dt->m_localport, dt->m_islocalip?&addr:NULL);
+
+    int acc_time = ACCEPT_TIME;
+    int sock;
+    if (sockfd < 0){
+        dt->errMsg("listen on %d failed", dt->m_localport);
+        return NULL;
+    }
+
+    while (!dt->isTerminate()){
+        dt->errMsg("listening on %d...", dt->m_localport);
+        sock = dt->m_nc.socket_accept(sockfd, dt->m_nc.get_options().accepttimeout, &dt->m_remote, dt->m_stopfd);
+        if (sock > 0){
+            dt->errMsg("get a connection from %s(%d)", dt->m_remote.szip, dt->m_remote.port);
+            dt->linkUp(sock);
+            dt->runLink();
+        }
+        if (acc_time != -1){
+            acc_time--;
+            if (acc_time <= 0)
+                break;
+        }
+    }
+
+    close(sockfd);
+    dt->errMsg("listen_clt thread terminate");
     return NULL;
 }
 
-void *DataTransmit::udp_clt_simplify(void *param)
+//udp server thread, the link is up once the first datagram arrives
+template<class T>
+void *DataTransmit::udp_listen(void *param)
 {
     DataTransmit *dt = (DataTransmit *)param;
+    int maxlen = dt->m_nc.get_options().maxdatalen;
     int sockfd, ret;
-    socklen_t len;
+    bool hashead;
     char *buf;
+    char *outbuf;
+    char *plain;
+    BH bh;
+    FRAME_INFO fi;
     struct sockaddr_in addr;
 
     sockfd = dt->m_nc.socket_new(SOCK_DGRAM);
@@ -573,279 +2074,234 @@ void *DataTransmit::udp_clt_simplify(void *param)
 
     addr.sin_family = AF_INET;
     addr.sin_port = htons(dt->m_localport);
-    if (dt->m_islocalip)
+    //bound to the group, datagrams sent to other groups on the port are filtered out
+    if (dt->m_ismulticast)
+        addr.sin_addr = dt->m_mcastgroup;
+    else if (dt->m_islocalip)
         addr.sin_addr.s_addr = inet_addr(dt->m_localip);
     else
         addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
     ret = bind(sockfd, (struct sockaddr *)&addr, sizeof(addr));
-    if (ret < 0){
+    if (ret < 0 || (dt->m_ismulticast && dt->m_nc.udp_join(sockfd, &dt->m_mcastgroup, &dt->m_mcastif) < 0)){
         close(sockfd);
         return NULL;
     }
 
-    buf = (char *)malloc(MAX_DATA_LEN);
-    memset(buf, 0, MAX_DATA_LEN);
+    buf = (char *)malloc(maxlen);
+    outbuf = T::framing_type::framed ? (char *)malloc(maxlen) : NULL;
+    hashead = false;
+    memset(&bh, 0, sizeof(BH));
 
-    dt->m_conn_sock = sockfd;
     dt->errMsg("listening on %d(udp)...", dt->m_localport);
 
-    while(!dt->m_isterminate){
-        len = sizeof(addr);
-        ret = recvfrom(sockfd, buf, MAX_DATA_LEN, MSG_DONTWAIT, (struct sockaddr*)&addr, &len);
+    while(!dt->isTerminate()){
+        ret = dt->m_nc.wait_fd(sockfd, false, -1, dt->m_stopfd);
+        if (ret < 0)
+            break;
+        ret = T::read(sockfd, buf, maxlen, &addr);
         if (ret < 0)
             continue;
         memcpy(&dt->m_udpaddr, &addr, sizeof(addr));
-        dt->errMsg("recv %d bytes from %s", ret, inet_ntoa(addr.sin_addr));
-        dt->m_isconnect = true;
-        if (ret <= 0){
-            dt->m_isconnect = false;
-            close(sockfd);
+        if (!dt->m_ismulticast)
+            dt->errMsg("recv %d bytes from %s", ret, inet_ntoa(addr.sin_addr));
+        if (ret == 0){
+            dt->linkDown();
             break;
         }
+        if (!dt->isConnected())
+            dt->linkUp(sockfd);
 
-        //callback function
-        if (dt->m_callbackfunc != NULL)
-            dt->m_callbackfunc(buf, ret);
-
+        if (!T::framing_type::framed){
+            //callback function
+            dt->deliver(buf, ret);
+            continue;
+        }
+        if (dt->m_ismulticast){
+            dt->onmulticast(buf, ret, outbuf, &addr);
+            continue;
+        }
+        //v1 block head and payload come in two datagrams
+        if (ret == sizeof(BH) && memcmp(buf, dt->m_sign, 8) == 0){
+            memcpy(&bh, buf, sizeof(bh));
+            hashead = true;
+            continue;
+        }
+        if (!hashead || (unsigned int)ret != bh.blen){
+            hashead = false;
+            dt->errMsg("unexpected datagram, %d bytes", ret);
+            continue;
+        }
+        hashead = false;
+        fi.version = 1;
+        fi.kind = FK_DATA;
+        fi.flags = FF_CRC | FF_CRYPT;
+        fi.len = bh.blen;
+        fi.chksum = bh.chksum;
+        fi.hdrlen = 0;
+        fi.opts = NULL;
+        fi.optlen = 0;
+        plain = T::check(&fi, buf, outbuf, dt->m_key);
+        if (plain == NULL){
+            dt->errMsg("checksum error");
+            continue;
+        }
+        dt->onframe(&fi, plain);
     }
-    dt->errMsg("udp_clt_simplify thread terminate");
+    pthread_mutex_lock(&dt->m_writemtx);
+    dt->m_conn_sock = -1;
+    close(sockfd);
+    pthread_mutex_unlock(&dt->m_writemtx);
     free(buf);
+    free(outbuf);
+    dt->errMsg("udp_listen thread terminate");
     return NULL;
 }
 
 void *DataTransmit::heart_beat(void *param)
 {
     DataTransmit *dt = (DataTransmit *)param;
-    char buf[16];
-    int ret;
-    strcpy(buf, "85j#$^dfgl@s23\0");
-    while(!dt->m_isterminate && dt->m_isconnect){
-        ret = send(dt->m_conn_sock, buf, 16, 0);
-        if (ret < 0){
-            dt->m_isconnect = false;
+
+    while(!dt->isTerminate() && dt->isConnected()){
+        //a failed write has taken the link down
+        if (LinkControl<DataTransmit>::heartbeat(dt) < 0)
+            break;
+        //woken up at once when the link drops or the connection stops
+        if (dt->m_nc.wait_fd(-1, false, dt->m_nc.get_options().heartbeatinterval*1000, dt->m_stopfd, dt->m_linkfd) != 0)
             break;
-        }
-        sleep(HEARTBEAT_INTERVAL);
     }
     dt->errMsg("heart_beat thread terminate");
     return NULL;
 }
 
-void *DataTransmit::connect_svr(void *param)
+void *DataTransmit::send_data(void *param)
 {
     DataTransmit *dt = (DataTransmit *)param;
-    void *tret;
-    while (!dt->m_isterminate){
-        dt->errMsg("connecting %s(%d)...", inet_ntoa(dt->m_addr), dt->m_svrport);
-        if (!dt->m_isudp)
-            dt->m_conn_sock = dt->m_nc.socket_new_connect(dt->m_svrport, &dt->m_addr);
+    eventfd_t val;
+    int ret;
+
+    while (dt->isConnected()){
+        eventfd_read(dt->m_sendfd, &val);
+        ret = dt->flushblocks();
+        if (ret < 0){
+            dt->linkDown();
+            break;
+        }
+        if (ret == 1)
+            ret = dt->m_nc.wait_fd(dt->m_conn_sock, true, -1, dt->m_stopfd, dt->m_linkfd);
         else
-            dt->m_conn_sock = dt->m_nc.udp_connect(dt->m_svrport, &dt->m_addr);
-        if (dt->m_conn_sock > 0){
-            dt->m_isconnect = true;
-            dt->errMsg("connect success");
-            if (dt->m_issimplify)
-                pthread_create(&dt->m_ptd_recv, NULL, dt->recv_data_simplify, dt);
-            else
-                pthread_create(&dt->m_ptd_recv, NULL, dt->recv_data, dt);
-            if (dt->m_isheartbeat)
-                pthread_create(&dt->m_ptd_heartbeat, NULL, dt->heart_beat, dt);
-            pthread_join(dt->m_ptd_recv, &tret);
+            ret = dt->m_nc.wait_fd(-1, false, -1, dt->m_sendfd, dt->m_linkfd);
+        if (ret == -1){
+            perror("select");
+            dt->linkDown();
+            break;
         }
-        sleep(CONN_INTERVAL);
     }
+    dt->errMsg("send_data thread terminate");
     return NULL;
 }
 
-void *DataTransmit::recv_data(void *param)
+void *DataTransmit::shm_recv(void *param)
 {
     DataTransmit *dt = (DataTransmit *)param;
-    fd_set in;
+    int maxlen = dt->m_nc.get_options().maxdatalen;
     int ret;
-    BH bh;
     char *buf;
-    char *outbuf;
-    struct timeval timest;
 
-    buf = (char *)malloc(MAX_RECV_LEN);
-    outbuf = (char *)malloc(MAX_RECV_LEN);
-    memset(&bh, 0, sizeof(BH));
-    memset(buf, 0, MAX_RECV_LEN);
-    memset(outbuf, 0, MAX_RECV_LEN);
-
-    while (!dt->m_isterminate && dt->m_isconnect){
-        FD_ZERO(&in);
-        FD_SET(dt->m_conn_sock, &in);
-        timest.tv_sec = RECV_TIMEOUT;
-        timest.tv_usec = 0;
-
-        ret = select(dt->m_conn_sock+1, &in, NULL, NULL, &timest);
-        if (ret < 0){
-            if (errno == EINTR)
-                continue;
-            perror("select");
+    buf = (char *)malloc(maxlen);
+    while (true){
+        ret = dt->m_shm.read(buf, maxlen);
+        if (ret < 0)
             break;
-        }
-        if (ret == 0)
-            continue;
-        if (FD_ISSET(dt->m_conn_sock, &in)){
-            ret = recv(dt->m_conn_sock, &bh, sizeof(BH), 0);
-            if (ret == 0){
-                dt->m_isconnect = false;
-                dt->errMsg("disconnected");
-                break;
-            }
+        //callback function
+        dt->deliver(buf, ret);
+    }
+    dt->errMsg("shm_recv thread terminate");
+    free(buf);
+    return NULL;
+}
 
-            if (ret == sizeof(BH) && memcmp(&bh.sign, dt->m_sign, 8) == 0){
-                if (bh.blen > MAX_RECV_LEN)
-                    continue;
-
-                ret = recv(dt->m_conn_sock, buf, bh.blen, 0);
-                //decrypt
-                dt->P_RC4(dt->m_key, (unsigned char*)buf, (unsigned char*)outbuf, bh.blen);
-                if (bh.chksum != (unsigned int)dt->crc32(0xffffffff, (unsigned char*)outbuf, ret)){
-                    dt->errMsg("checksum error");
-                }
-                else{
-                    //callback function
-                    if (dt->m_callbackfunc != NULL)
-                        dt->m_callbackfunc(outbuf, bh.blen);
-                }
-            }
-            else if(ret == 16){
-                //heart beat packet
-            }
-            else{
-                ret = recv(dt->m_conn_sock, buf, MAX_DATA_LEN, 0);
-            }
+void *DataTransmit::connect_svr(void *param)
+{
+    DataTransmit *dt = (DataTransmit *)param;
+    int sock;
+    while (!dt->isTerminate()){
+        dt->applyoptions();
+        dt->errMsg("connecting %s(%d)...", inet_ntoa(dt->m_addr), dt->m_svrport);
+        if (!dt->m_isudp)
+            sock = dt->m_nc.socket_new_connect(dt->m_svrport, &dt->m_addr, dt->m_stopfd);
+        else
+            sock = dt->m_nc.udp_connect(dt->m_svrport, &dt->m_addr, &dt->m_mcastif);
+        if (sock > 0){
+            dt->errMsg("connect success");
+            dt->linkUp(sock);
+            dt->runLink();
         }
+        if (dt->m_nc.wait_fd(-1, false, dt->m_nc.get_options().conninterval*1000, dt->m_stopfd) != 0)
+            break;
     }
-    dt->errMsg("recv_data thread terminate");
-    free(outbuf);
-    free(buf);
+    dt->errMsg("connect_svr thread terminate");
     return NULL;
 }
 
-void *DataTransmit::recv_data_simplify(void *param)
+//receive thread of a link, a framed transport decodes the stream into frames
+template<class T>
+void *DataTransmit::recv_link(void *param)
 {
     DataTransmit *dt = (DataTransmit *)param;
-    fd_set in;
-    int ret;
+    int maxlen = T::framing_type::framed ? dt->m_nc.get_options().maxrecvlen : dt->m_nc.get_options().maxdatalen;
+    int bufsize = T::framing_type::framed ? maxlen + FRAME_MAX_HEAD : maxlen;
+    int ret, used, off;
     char *buf;
-    struct timeval timest;
+    FrameDecoder<T> decoder(dt->m_sign, dt->m_key, maxlen, &dt->m_resyncs, &dt->m_resyncbytes);
 
-    buf = (char *)malloc(MAX_DATA_LEN);
-    memset(buf, 0, MAX_DATA_LEN);
+    buf = (char *)malloc(bufsize);
+    used = 0;
 
-    while (!dt->m_isterminate && dt->m_isconnect){
-        FD_ZERO(&in);
-        FD_SET(dt->m_conn_sock, &in);
-        timest.tv_sec = RECV_TIMEOUT;
-        timest.tv_usec = 0;
-
-        ret = select(dt->m_conn_sock+1, &in, NULL, NULL, &timest);
-        if (ret < 0){
-            if (errno == EINTR)
-                continue;
+    while (!dt->isTerminate() && dt->isConnected()){
+        ret = dt->m_nc.wait_fd(dt->m_conn_sock, false, dt->m_nc.get_options().recvtimeout*1000, dt->m_stopfd, dt->m_linkfd);
+        if (ret == -1){
             perror("select");
             break;
         }
+        if (ret == -2)
+            break;
         if (ret == 0)
             continue;
-        if (FD_ISSET(dt->m_conn_sock, &in)){
-            ret = recv(dt->m_conn_sock, buf, MAX_DATA_LEN, 0);
-            if (ret <= 0){
-                dt->m_isconnect = false;
-                dt->errMsg("disconnected");
-                break;
-            }
-            if (dt->m_callbackfunc != NULL)
-                dt->m_callbackfunc(buf, ret);
-        }
-    }
-    dt->errMsg("recv_data_simplify thread terminate");
-    free(buf);
-    return NULL;
-}
 
-void DataTransmit::init_crc_table()
-{
-    unsigned int c;
-    unsigned int i,j;
+        if (dt->m_istrace){
+            ret = NetCore::recv_stamped(dt->m_conn_sock, buf+used, bufsize-used, &dt->m_rxts);
+            dt->m_recvts = Tracer::now();
+        }
+        else
+            ret = T::read(dt->m_conn_sock, buf+used, bufsize-used, NULL);
+        dt->m_nc.rearm_quickack(dt->m_conn_sock);
+        if (ret == 0 || (ret < 0 && errno != EINTR && errno != EAGAIN)){
+            dt->linkDown();
+            dt->errMsg("disconnected");
+            break;
+        }
+        if (ret < 0)
+            continue;
+        if (!T::framing_type::framed){
+            //callback function
+            dt->deliver(buf, ret);
+            continue;
+        }
+        used += ret;
 
-    for(i=0; i<256; i++)
-    {
-        c = i;
-        for(j=0; j<8; j++)
-        {
-            if(c & 1)
-                c = 0xedb88320L ^ (c>>1);
-            else
-                c = c >> 1;
+        off = decoder.decode(buf, used, [dt](const FRAME_INFO *fi, char *plain){ dt->onframe(fi, plain); });
+        if (off > 0){
+            memmove(buf, buf+off, used-off);
+            used -= off;
         }
-        crc_table[i] = c;
     }
-}
-
-int DataTransmit::crc32(unsigned int crc, unsigned char *buffer, unsigned int size)
-{
-    unsigned int i;
-    for(i=0; i<size; i++)
-        crc = crc_table[(crc^buffer[i])&0xff]^(crc>>8);
-    return crc;
+    dt->errMsg("recv_link thread terminate");
+    free(buf);
+    return NULL;
 }
 
 void DataTransmit::init_key()
 {
-    m_key[0] = 0;
-    m_key[1] = 3;
-    m_key[2] = 0;
-    m_key[3] = 2;
-    m_key[4] = 7;
-    m_key[5] = 0;
-    m_key[6] = 5;
-    m_key[7] = 6;
-    m_key[8] = 0x0A;
-    m_key[9] = 5;
-    m_key[10] = 6;
-    m_key[11] = 0x0B;
-    m_key[12] = 5;
-    m_key[13] = 6;
-    m_key[14] = 6;
-    m_key[15] = 0x0B;
-}
-
-void DataTransmit::P_RC4(unsigned char *pkey, unsigned char *pin, unsigned char *pout, unsigned int len)
-{
-    unsigned char S[256],K[256],temp;
-    unsigned int  i,j,t,x;
-
-    j = 1;
-    for(i=0;i<256;i++)
-    {
-        S[i] = (unsigned char)i;
-        if(j > 16) j = 1;
-        K[i] = pkey[j-1];
-        j++;
-    }
-    j = 0;
-    for(i=0;i<256;i++)
-    {
-        j = (j + S[i] + K[i]) % 256;
-        temp = S[i];
-        S[i] = S[j];
-        S[j] = temp;
-    }
-    i = j = 0;
-    for(x=0;x<len;x++)
-    {
-        i = (i+1) % 256;
-        j = (j + S[i]) % 256;
-        temp = S[i];
-        S[i] = S[j];
-        S[j] = temp;
-        t = (S[i] + (S[j] % 256)) % 256;
-        pout[x] = pin[x] ^ S[t];
-    }
+    memcpy(m_key, CRYPT_KEY, 16);
 }
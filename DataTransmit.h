@@ -2,6 +2,14 @@
 #define DATATRANSMIT_H
 
 #include "CmnHdr.h"
+#include "ShmRing.h"
+#include "WireFormat.h"
+#include "Capture.h"
+#include "Trace.h"
+#include "Dedup.h"
+#include "Pacing.h"
+#include "Transport.h"
+#include "Control.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,17 +27,51 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <signal.h>
+#include <sys/eventfd.h>
+#include <netinet/tcp.h>
+#include <netinet/ip.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <atomic>
+#include <map>
+#include <set>
+
+//SendToGroup encodes one frame per wire format version, and one more for traced v2 members
+#define GROUP_FRAMES (FRAME_VERSION + 2)
 
 class NetCore
 {
 public:
-    static int socket_new(int type);
-    static int socket_new_connect(int port, const struct in_addr *addr);
-    static int socket_new_listen(int type, int port, const struct in_addr *addr);
-    static int socket_accept(int sockfd, int timeout, struct HOST_INFO *hostinfo);
-    static int udp_connect(/*int localport, */int remoteport, const struct in_addr *addr);
+    NetCore();
+    int  set_options(const struct TRANSPORT_OPTS *opts);//-1 if they are invalid, nothing changes then
+    const struct TRANSPORT_OPTS &get_options() const;
+    int  socket_new(int type);
+    int  socket_options(int sock, int type);
+    int  socket_new_connect(int port, const struct in_addr *addr, int wakefd=-1);
+    int  socket_new_listen(int type, int port, const struct in_addr *addr);
+    int  socket_accept(int sockfd, int timeout, struct HOST_INFO *hostinfo, int wakefd=-1);
+    int  udp_connect(/*int localport, */int remoteport, const struct in_addr *addr, const struct in_addr *ifaddr=NULL);
+    int  udp_multicast(int sock, const struct in_addr *ifaddr);
+    int  udp_join(int sock, const struct in_addr *group, const struct in_addr *ifaddr);
+    void rearm_quickack(int sock);
+    static int max_pacing(int sock, int rate);
+    int  rx_timestamps(int sock);
+    //recv with the kernel software rx stamp of the data, rxts is 0 if there is none
+    static int recv_stamped(int sock, char *buf, int len, uint64_t *rxts);
+    static void default_options(struct TRANSPORT_OPTS *opts);
+    static void low_latency_options(struct TRANSPORT_OPTS *opts);
+    static void bulk_throughput_options(struct TRANSPORT_OPTS *opts);
+    //wait for sockfd(may be -1) or one of the wake fds, timeout in ms(-1 means infinitely)
+    //return 1 sockfd ready, 0 timeout, -1 error, -2 woken up
+    static int wait_fd(int sockfd, bool forwrite, int timeout, int wakefd=-1, int wakefd2=-1);
+    static bool is_local_addr(const struct in_addr *addr);
+    static bool check_options(const struct TRANSPORT_OPTS *opts);
+
+private:
+    struct TRANSPORT_OPTS m_opts;
 };
 
 class DataTransmit
@@ -38,61 +80,205 @@ public:
     DataTransmit(const char *svr_ip, int svr_port);
     DataTransmit(int local_port, const char *local_ip=NULL);
     ~DataTransmit();
-    void SetCallbackfunction(callback_t func);
+    void SetCallbackfunction(callback_t func);//runs on the recv thread, or the shared memory thread once switched
+    //messages sent with SendRpc go to func instead of the callback function, set it before InitialConnection
+    //func is called with a NULL head once a link is down and no more messages come from it
+    void SetRpcHandler(rpchook_t func, void *ctx);
+    void SetCapture(Capture *cap);//record sent and received messages, cap may be shared by several instances
+    void SetTracing(bool set);//stamp v2 data frames and keep per-stage latency histograms(tcp only)
+    Tracer *GetTracer();
     void SetUseUdp(bool set);
     void SetSimplify(bool set);//if set = true, transmition will not use crypt or block head
+    void SetMulticast(const char *group, const char *ifaddr=NULL);//udp multicast, a client publishes to group, a server subscribes to it
+    void SetDedup(bool set);//send large messages as content-defined chunks, repeated chunks as references(tcp only, both ends)
+    void SetNonBlocking(bool set);//if set = true, messages are queued and sent by a background thread(tcp only)
+    void SetSendBuffer(int limit, int highmark, int lowmark);//the next link starts with it
+    void SetPacing(int rate, int burst, bool fq=false);//send rate limit(bytes/s, 0 means unlimited), may be changed while connected
+    static void SetGlobalPacing(int rate, int burst);//rate limit shared by every connection of the process
+    void SetTransportOptions(const TRANSPORT_OPTS *opts);//invalid ones are ignored, the next link starts with them
+    TRANSPORT_OPTS GetTransportOptions();
+    //high runs on the thread whose send crossed the high watermark, low on the send thread,
+    //neither holds a lock so they may send or stop the connection
+    void SetWatermarkCallback(notify_t high, notify_t low);
+    void SetWritableCallback(notify_t func);//runs on the send thread once a rejected TrySend would fit again
     int SendData(char *buf, int len);
+    int TrySend(char *buf, int len);//return SEND_WOULDBLOCK when the send buffer is full
+    //send a message with a rpc head(at most FO_RPC_MAX bytes) for the peer's rpc handler, as TrySend if nowait
+    //return -1 unless both ends set a rpc handler and the link is tcp with wire format v2
+    int SendRpc(const char *head, int headlen, char *buf, int len, bool nowait);
+    int GetSendBuffered();
+    //encode once and queue to every connected member, a slow member only misses messages instead of
+    //stalling the rest, blocking and udp members are skipped, return how many members took the message
+    //tracing members share a stamped frame and the others an unstamped one, whatever the member order
+    static int SendToGroup(DataTransmit **group, int count, char *buf, int len);
     int RecvData(char *buf, int len);
     void InitialConnection();
     void StopConnection();
     int GetConnectionStatus();
+    CONN_STATE GetConnectionState();
+    int GetSharedMemoryStatus();//1 once sent data goes through the shared memory ring
+    unsigned long GetSharedMemoryDrops();//messages from the ring longer than maxdatalen, skipped
     int GetConnectionPort();
     HOST_INFO GetRemoteHostInfo();
+    void GetResyncStats(unsigned long *events, unsigned long *skipped);
+    void GetMulticastStats(unsigned long *received, unsigned long *lost);
+    void GetDedupStats(unsigned long *bytes, unsigned long *encoded);//message bytes deduped and recipe bytes sent for them
+    void GetPacingStats(unsigned long *throttled, unsigned long *waited);//sends delayed by pacing and the total delay(us)
+    static void GetGlobalPacingStats(unsigned long *throttled, unsigned long *waited);
 
 private:
+    friend class LinkControl<DataTransmit>;
+
     int m_svrport;
     int m_localport;
     struct in_addr m_addr;
+    struct in_addr m_mcastgroup;
+    struct in_addr m_mcastif;
     struct sockaddr_in m_udpaddr;
     struct HOST_INFO m_local;
     struct HOST_INFO m_remote;
     bool m_isserver;
-    bool m_isterminate;
-    bool m_isconnect;
+    bool m_isrunning;   //connection thread created and not joined yet
     bool m_isheartbeat;
     bool m_isudp;
     bool m_islocalip;
     bool m_issimplify;
+    bool m_ismulticast;
+    bool m_isnonblock;
+    bool m_isdedup;
+    bool m_isabovehigh;     //high watermark crossed, waiting for low watermark
+    bool m_iswouldblock;    //TrySend rejected, waiting for writable
     char m_localip[16];
     unsigned char m_sign[8];
     unsigned char m_key[16];
-    unsigned int  crc_table[256];
     int m_conn_sock;
+    int m_stopfd;       //eventfd, signalled by StopConnection
+    int m_linkfd;       //eventfd, signalled when current link drops
+    std::atomic<int> m_state;
     callback_t m_callbackfunc;
-    NetCore m_nc;
+    rpchook_t m_rpcfunc;
+    void *m_rpcctx;
+    bool m_isrpc;           //CT_RPC agreed on this link, guarded by m_writemtx
+    Capture *m_capture;
+    unsigned int m_connid;  //changes with every link, tells links apart in a capture
+    bool m_istrace;
+    Tracer m_tracer;
+    uint64_t m_tracesend;   //SendData entry of the frame being encoded, guarded by m_writemtx
+    uint64_t m_traceenc;    //encode done of the last traced frame, guarded by m_writemtx
+    const unsigned char *m_sendopt; //FO_RPC option of the frame being encoded or NULL, guarded by m_writemtx
+    uint64_t m_rxts;        //kernel rx stamp of the last recv, recv thread only
+    uint64_t m_recvts;      //return of the last recv, recv thread only
+    notify_t m_highfunc;
+    notify_t m_lowfunc;
+    notify_t m_writablefunc;
+    int m_sendfd;           //eventfd, signalled when a block is queued
+    int m_sendbuffered;
+    int m_highpending;      //buffered when the high watermark was crossed, -1 if not reported yet
+    PSB m_sendhead;
+    PSB m_sendtail;
+    pthread_mutex_t m_sendmtx;
+    pthread_mutex_t m_writemtx;     //keeps tcp frames whole and orders the switch to shared memory
+    pthread_mutex_t m_shmmtx;
+    ShmRing m_shm;
+    std::atomic<bool> m_isshmsend;
+    std::atomic<int> m_shmpeermax;  //maxdatalen of the peer reading the ring, 0 if it did not say
+    std::atomic<int> m_wirever;     //wire format version used for sending
+    std::atomic<unsigned long> m_resyncs;
+    std::atomic<unsigned long> m_resyncbytes;
+    unsigned int m_mcastseq;        //last sequence number published
+    std::map<uint64_t, unsigned int> m_mcastlast;  //last sequence number received per publisher addr<<16|port
+    std::atomic<unsigned long> m_mcastrecv;
+    std::atomic<unsigned long> m_mcastlost;
+    bool m_isshmrecv;
+    TokenBucket m_pacer;
+    Dedup m_dedup;          //send half guarded by m_writemtx, receive half recv thread only
+    NetCore m_nc;           //options of the current link, only changed between links
+    TRANSPORT_OPTS m_nextopts;
+    bool m_isoptschanged;
+    pthread_mutex_t m_optsmtx;      //guards m_nextopts
+    //chosen by selectTransport for the transport of the link
+    int  (DataTransmit::*m_sendfunc)(char *buf, int len, bool nowait, uint64_t entry, const unsigned char *opt);
+    int  (DataTransmit::*m_groupfunc)(char *buf, int len, PSF *frames, uint64_t entry);  //NULL without a send queue
+    int  (DataTransmit::*m_framefunc)(int kind, const char *buf, int len, bool toshm, int newver);
+    void *(*m_recvfunc)(void *param);
 
     pthread_t m_ptd_connsvr;
     pthread_t m_ptd_lsnclt;
     pthread_t m_ptd_recv;
     pthread_t m_ptd_heartbeat;
+    pthread_t m_ptd_send;
+    pthread_t m_ptd_shm;
 
     void initialParam();
+    bool isConnected();
+    bool isTerminate();
+    bool isownthread();
+    void linkUp(int sock);
+    void linkDown();
+    bool applyoptions();
+    void runLink();
     void resolveHost(const char *szname);
     void errMsg(const char *fmt, ...);
-    int  senddatasimplify(char *buf, int len);
-    int  senddatanormaly(char *buf, int len);
-    void P_RC4(unsigned char* pkey, unsigned char* pin, unsigned char* pout, unsigned int len);
+    void selectTransport();
+    template<class T, bool queued> void usetransport();
+    int  sendmsg(char *buf, int len, bool nowait, const unsigned char *opt=NULL);
+    template<class T> int writemessage(char *buf, int len, bool nowait, uint64_t entry, const unsigned char *opt);
+    template<class T> int queuemessage(char *buf, int len, bool nowait, uint64_t entry, const unsigned char *opt);
+    template<class T> int sendmessage(char *buf, int len, int paced);
+    int  senddatamulticast(char *buf, int len, bool nowait, uint64_t entry, const unsigned char *opt);
+    void onmulticast(char *buf, int len, char *outbuf, const struct sockaddr_in *from);
+    template<class T> int queueblock(char *buf, int len, bool force);
+    int  queueframe(const char *frame, int len);
+    int  queueshared(PSF sf, int len);
+    bool reserveblock(int blen, bool force);
+    void appendblock(PSB sb, int reserved);
+    static PSB newblock(int size);
+    void notifyhigh();
+    int  trysendshared(char *buf, int len, PSF *frames);
+    template<class T> int queuegroup(char *buf, int len, PSF *frames, uint64_t entry);
+    template<class T> PSF newshared(const char *buf, int len, int ver);
+    void pace(int len);
+    void unpace(int len);
+    static TokenBucket *globalpacer();
+    static pthread_mutex_t *pacefdsmtx();
+    static std::set<int> *pacefds();    //eventfd of every pacing wait in progress, guarded by pacefdsmtx
+    static void wakepacers();
+    static void releaseshared(PSF sf);
+    static void freeblock(PSB sb);
+    int  flushblocks();
+    void clearblocks();
+    template<class T> int encodeframe(char *out, int kind, const char *buf, int len, int ver=0, bool dedup=false);
+    template<class T> int encodedata(char *out, const char *buf, int len, int ver, bool dedup=false);
+    int  framebound(int len);
+    void onframe(const FRAME_INFO *fi, char *plain);
+    void deliver(char *buf, int len, const unsigned char *rpc=NULL, int rpclen=-1);
+    int  sendcontrol(int type, const char *data, int len, bool toshm=false, int newver=0);
+    template<class T, bool queued> int sendframe(int kind, const char *buf, int len, bool toshm, int newver);
+    int  sendheartbeat();
+    int  sendpending();
+    void setversion(int ver);
+    int  sendshm(char *buf, int len, bool nowait);
+    void offerdedup();
+    void ondedup(char *data, int len);
+    void offerrpc();
+    void onrpc();
+    void offershm();
+    bool attachshm(char *data, int len);
+    void onshmaccept(char *data, int len);
+    void onshmreject();
+    void onshmswitch();
+    void setshmpeermax(const char *data, int len);
+    void startshm();
+    void stopshm();
     void init_key();
-    void init_crc_table();
-    int  crc32(unsigned int crc, unsigned char *buffer, unsigned int size);
 
     static void *connect_svr(void *param);
     static void *listen_clt(void *param);
-    static void *recv_data(void *param);
-    static void *recv_data_simplify(void *param);
+    template<class T> static void *recv_link(void *param);
     static void *heart_beat(void *param);
-    static void *udp_clt(void *param);
-    static void *udp_clt_simplify(void *param);
+    static void *send_data(void *param);
+    static void *shm_recv(void *param);
+    template<class T> static void *udp_listen(void *param);
 };
 
 #endif // DATATRANSMIT_H
@@ -1,13 +1,32 @@
 TEMPLATE = app
 CONFIG += console
 CONFIG += thread
+CONFIG += c++11
 CONFIG -= app_bundle
 CONFIG -= qt
 
 SOURCES += main.cpp \
-    DataTransmit.cpp
+    DataTransmit.cpp \
+    ShmRing.cpp \
+    WireFormat.cpp \
+    Capture.cpp \
+    Trace.cpp \
+    Dedup.cpp \
+    Pacing.cpp \
+    Rpc.cpp
 
 HEADERS += \
     CmnHdr.h \
-    DataTransmit.h
+    DataTransmit.h \
+    ShmRing.h \
+    WireFormat.h \
+    Capture.h \
+    Trace.h \
+    Dedup.h \
+    Pacing.h \
+    Transport.h \
+    Control.h \
+    Rpc.h
+
+LIBS += -lrt
 
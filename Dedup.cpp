@@ -0,0 +1,339 @@
+#include "Dedup.h"
+#include "WireFormat.h"
+#include <stdlib.h>
+#include <string.h>
+
+//sha-256(FIPS 180-4), only the chunk digests use it
+static const uint32_t sha_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t *h, const unsigned char *p)
+{
+    uint32_t w[64], a, b, c, d, e, f, g, k, t1, t2;
+    int i;
+
+    for (i=0; i<16; i++)
+        w[i] = (uint32_t)p[i*4] << 24 | (uint32_t)p[i*4+1] << 16 | (uint32_t)p[i*4+2] << 8 | p[i*4+3];
+    for (i=16; i<64; i++)
+        w[i] = w[i-16] + (ROTR(w[i-15], 7) ^ ROTR(w[i-15], 18) ^ (w[i-15] >> 3)) +
+               w[i-7] + (ROTR(w[i-2], 17) ^ ROTR(w[i-2], 19) ^ (w[i-2] >> 10));
+    a = h[0]; b = h[1]; c = h[2]; d = h[3];
+    e = h[4]; f = h[5]; g = h[6]; k = h[7];
+    for (i=0; i<64; i++){
+        t1 = k + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha_k[i] + w[i];
+        t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static void sha256(const unsigned char *buf, size_t len, unsigned char out[32])
+{
+    uint32_t h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    unsigned char tail[128];
+    uint64_t bits;
+    size_t i, rest, taillen;
+
+    for (i=0; i+64<=len; i+=64)
+        sha256_block(h, buf + i);
+    rest = len - i;
+    memcpy(tail, buf + i, rest);
+    tail[rest] = 0x80;
+    taillen = rest + 1 + 8 <= 64 ? 64 : 128;
+    memset(tail + rest + 1, 0, taillen - rest - 1);
+    bits = (uint64_t)len * 8;
+    for (i=0; i<8; i++)
+        tail[taillen - 1 - i] = (unsigned char)(bits >> (i * 8));
+    sha256_block(h, tail);
+    if (taillen == 128)
+        sha256_block(h, tail + 64);
+    for (i=0; i<8; i++){
+        out[i*4] = (unsigned char)(h[i] >> 24);
+        out[i*4+1] = (unsigned char)(h[i] >> 16);
+        out[i*4+2] = (unsigned char)(h[i] >> 8);
+        out[i*4+3] = (unsigned char)h[i];
+    }
+}
+
+//random gear values, the same table on every host is not required since only the sender chunks
+struct GearTable{
+    uint64_t v[256];
+    GearTable()
+    {
+        uint64_t x = 0x9e3779b97f4a7c15ULL, z;
+        int i;
+
+        //splitmix64
+        for (i=0; i<256; i++){
+            x += 0x9e3779b97f4a7c15ULL;
+            z = x;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            v[i] = z ^ (z >> 31);
+        }
+    }
+};
+
+static const GearTable gear;
+
+bool DEDUP_DIGEST::operator==(const DEDUP_DIGEST &other) const
+{
+    return memcmp(v, other.v, DEDUP_DIGEST_LEN) == 0;
+}
+
+size_t DigestHash::operator()(const DEDUP_DIGEST &d) const
+{
+    size_t h;
+
+    memcpy(&h, d.v, sizeof(h));
+    return h;
+}
+
+ChunkCache::ChunkCache()
+{
+    m_capacity = 0;
+    m_used = 0;
+    m_hasdata = false;
+}
+
+ChunkCache::~ChunkCache()
+{
+    clear();
+}
+
+void ChunkCache::clear()
+{
+    std::list<CHUNK_ENTRY>::iterator it;
+
+    for (it=m_lru.begin(); it!=m_lru.end(); ++it)
+        free(it->data);
+    m_lru.clear();
+    m_map.clear();
+    m_used = 0;
+}
+
+void ChunkCache::Reset(long capacity, bool hasdata)
+{
+    clear();
+    m_capacity = capacity;
+    m_hasdata = hasdata;
+}
+
+long ChunkCache::GetCapacity()
+{
+    return m_capacity;
+}
+
+bool ChunkCache::Touch(const DEDUP_DIGEST &d, const char **data, int *len)
+{
+    std::unordered_map<DEDUP_DIGEST, std::list<CHUNK_ENTRY>::iterator, DigestHash>::iterator it;
+
+    it = m_map.find(d);
+    if (it == m_map.end())
+        return false;
+    m_lru.splice(m_lru.begin(), m_lru, it->second);
+    *data = it->second->data;
+    *len = it->second->len;
+    return true;
+}
+
+void ChunkCache::Insert(const DEDUP_DIGEST &d, const char *data, int len)
+{
+    CHUNK_ENTRY e;
+
+    if (len > m_capacity || m_map.find(d) != m_map.end())
+        return;
+    while (m_used + len > m_capacity){
+        m_used -= m_lru.back().len;
+        m_map.erase(m_lru.back().d);
+        free(m_lru.back().data);
+        m_lru.pop_back();
+    }
+    e.d = d;
+    e.len = len;
+    e.data = NULL;
+    if (m_hasdata){
+        e.data = (char *)malloc(len);
+        memcpy(e.data, data, len);
+    }
+    m_lru.push_front(e);
+    m_map[d] = m_lru.begin();
+    m_used += len;
+}
+
+Dedup::Dedup()
+{
+    m_issend = false;
+    m_isrecv = false;
+    m_encbuf = m_decbuf = NULL;
+    m_encsize = m_decsize = 0;
+    m_bytes = 0;
+    m_encoded = 0;
+}
+
+Dedup::~Dedup()
+{
+    free(m_encbuf);
+    free(m_decbuf);
+}
+
+void Dedup::StartSend(long cachesize)
+{
+    m_sent.Reset(cachesize, false);
+    m_issend = cachesize > 0;
+}
+
+void Dedup::StartRecv(long cachesize)
+{
+    m_recv.Reset(cachesize, true);
+    m_isrecv = cachesize > 0;
+}
+
+//a new link starts with empty caches on both ends
+void Dedup::Stop()
+{
+    m_issend = false;
+    m_isrecv = false;
+    m_sent.Reset(0, false);
+    m_recv.Reset(0, true);
+}
+
+bool Dedup::IsSending()
+{
+    return m_issend;
+}
+
+int Dedup::Bound(int len)
+{
+    return len + (len / DEDUP_MIN_CHUNK + 1) * (1 + DEDUP_DIGEST_LEN + 5);
+}
+
+void Dedup::digest(const char *buf, int len, DEDUP_DIGEST *d)
+{
+    unsigned char h[32];
+
+    sha256((const unsigned char *)buf, len, h);
+    memcpy(d->v, h, DEDUP_DIGEST_LEN);
+}
+
+//length of the next chunk, the top bits of the gear hash depend on the last 64 bytes
+int Dedup::cut(const unsigned char *buf, int len)
+{
+    const uint64_t mask = ((1ULL << DEDUP_AVG_BITS) - 1) << (64 - DEDUP_AVG_BITS);
+    uint64_t h;
+    int i, end;
+
+    if (len <= DEDUP_MIN_CHUNK)
+        return len;
+    end = len < DEDUP_MAX_CHUNK ? len : DEDUP_MAX_CHUNK;
+    h = 0;
+    for (i=DEDUP_MIN_CHUNK-64; i<end; i++){
+        h = (h << 1) + gear.v[buf[i]];
+        if (i >= DEDUP_MIN_CHUNK && (h & mask) == 0)
+            return i + 1;
+    }
+    return end;
+}
+
+int Dedup::Encode(const char *buf, int len, const char **out)
+{
+    DEDUP_DIGEST d;
+    const char *data;
+    unsigned char *p;
+    int pos, clen, n, bound, dlen;
+
+    bound = Bound(len);
+    if (bound > m_encsize){
+        free(m_encbuf);
+        m_encbuf = (char *)malloc(bound);
+        m_encsize = bound;
+    }
+    p = (unsigned char *)m_encbuf;
+    n = 0;
+    for (pos=0; pos<len; pos+=clen){
+        clen = cut((const unsigned char *)buf + pos, len - pos);
+        digest(buf + pos, clen, &d);
+        if (m_sent.Touch(d, &data, &dlen)){
+            p[n++] = DEDUP_REF;
+            memcpy(p + n, d.v, DEDUP_DIGEST_LEN);
+            n += DEDUP_DIGEST_LEN;
+            continue;
+        }
+        m_sent.Insert(d, NULL, clen);
+        p[n++] = DEDUP_LITERAL;
+        memcpy(p + n, d.v, DEDUP_DIGEST_LEN);
+        n += DEDUP_DIGEST_LEN;
+        n += WireFormat::put_varint(p + n, clen);
+        memcpy(p + n, buf + pos, clen);
+        n += clen;
+    }
+    m_bytes += len;
+    m_encoded += n;
+    *out = m_encbuf;
+    return n;
+}
+
+int Dedup::Decode(const char *recipe, int len, int maxlen, const char **out)
+{
+    const unsigned char *p = (const unsigned char *)recipe;
+    DEDUP_DIGEST d;
+    const char *data;
+    unsigned int clen;
+    int pos, n, ret, dlen;
+
+    if (!m_isrecv)
+        return -1;
+    if (maxlen > m_decsize){
+        free(m_decbuf);
+        m_decbuf = (char *)malloc(maxlen);
+        m_decsize = maxlen;
+    }
+    n = 0;
+    pos = 0;
+    while (pos < len){
+        if (pos + 1 + DEDUP_DIGEST_LEN > len)
+            return -1;
+        memcpy(d.v, p + pos + 1, DEDUP_DIGEST_LEN);
+        if (p[pos] == DEDUP_REF){
+            pos += 1 + DEDUP_DIGEST_LEN;
+            if (!m_recv.Touch(d, &data, &dlen) || n + dlen > m_decsize)
+                return -1;
+            memcpy(m_decbuf + n, data, dlen);
+            n += dlen;
+            continue;
+        }
+        if (p[pos] != DEDUP_LITERAL)
+            return -1;
+        pos += 1 + DEDUP_DIGEST_LEN;
+        ret = WireFormat::get_varint(p + pos, len - pos, &clen);
+        if (ret <= 0 || clen > (unsigned int)(len - pos - ret) || n + (int)clen > m_decsize)
+            return -1;
+        pos += ret;
+        m_recv.Insert(d, recipe + pos, clen);
+        memcpy(m_decbuf + n, recipe + pos, clen);
+        n += clen;
+        pos += clen;
+    }
+    *out = m_decbuf;
+    return n;
+}
+
+void Dedup::GetStats(unsigned long *bytes, unsigned long *encoded)
+{
+    *bytes = m_bytes;
+    *encoded = m_encoded;
+}
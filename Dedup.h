@@ -0,0 +1,100 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <list>
+#include <unordered_map>
+#include <atomic>
+
+//Content-defined chunking, a gear rolling hash over the last 64 bytes picks the cut points
+//so an edit only changes the chunks around it
+#define DEDUP_MIN_CHUNK 2048
+#define DEDUP_AVG_BITS 13           //8KB average chunk
+#define DEDUP_MAX_CHUNK 65536
+#define DEDUP_MIN_LEN 4096          //shorter messages are sent as they are
+#define DEDUP_DIGEST_LEN 16         //truncated sha-256
+
+//Chunk recipe, the payload of a FO_DEDUP data frame
+//  literal: DEDUP_LITERAL digest varint len bytes, the receiver caches the chunk
+//  reference: DEDUP_REF digest, the receiver copies the chunk from its cache
+#define DEDUP_LITERAL 0
+#define DEDUP_REF 1
+
+typedef struct DEDUP_DIGEST{
+    unsigned char v[DEDUP_DIGEST_LEN];
+    bool operator==(const DEDUP_DIGEST &other) const;
+}DD;
+
+struct DigestHash
+{
+    size_t operator()(const DEDUP_DIGEST &d) const;
+};
+
+//LRU bounded by chunk bytes. Both ends apply the same inserts and touches
+//in the same order, so the sender's copy(without data) mirrors the receiver's.
+class ChunkCache
+{
+public:
+    ChunkCache();
+    ~ChunkCache();
+    void Reset(long capacity, bool hasdata);
+    //move a cached chunk to the front, data is NULL in a cache without data
+    bool Touch(const DEDUP_DIGEST &d, const char **data, int *len);
+    //a chunk larger than the whole cache is not kept, on either end
+    void Insert(const DEDUP_DIGEST &d, const char *data, int len);
+    long GetCapacity();
+
+private:
+    typedef struct CHUNK_ENTRY{
+        DEDUP_DIGEST d;
+        int len;
+        char *data;
+    }CE;
+
+    std::list<CHUNK_ENTRY> m_lru;       //most recent first
+    std::unordered_map<DEDUP_DIGEST, std::list<CHUNK_ENTRY>::iterator, DigestHash> m_map;
+    long m_capacity;
+    long m_used;
+    bool m_hasdata;
+
+    void clear();
+};
+
+//Dedup state of one link, the send half is used under the writer lock
+//and the receive half by the receive thread only
+class Dedup
+{
+public:
+    Dedup();
+    ~Dedup();
+    void StartSend(long cachesize);
+    void StartRecv(long cachesize);
+    void Stop();
+    bool IsSending();
+    //longest recipe of a len bytes message
+    static int Bound(int len);
+    //split buf into chunks, out points to the recipe until the next Encode, return its length
+    int  Encode(const char *buf, int len, const char **out);
+    //rebuild a message, out points to it until the next Decode
+    //return its length, -1 if a referenced chunk is missing or the recipe is corrupted
+    int  Decode(const char *recipe, int len, int maxlen, const char **out);
+    void GetStats(unsigned long *bytes, unsigned long *encoded);
+    static void digest(const char *buf, int len, DEDUP_DIGEST *d);
+
+private:
+    bool m_issend;
+    bool m_isrecv;
+    ChunkCache m_sent;      //what the peer has, without data
+    ChunkCache m_recv;
+    char *m_encbuf;
+    int  m_encsize;
+    char *m_decbuf;
+    int  m_decsize;
+    std::atomic<unsigned long> m_bytes;     //message bytes encoded
+    std::atomic<unsigned long> m_encoded;   //recipe bytes produced
+
+    static int cut(const unsigned char *buf, int len);
+};
+
+#endif // DEDUP_H
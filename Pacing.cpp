@@ -0,0 +1,106 @@
+#include "Pacing.h"
+#include <time.h>
+
+TokenBucket::TokenBucket()
+{
+    pthread_mutex_init(&m_mtx, NULL);
+    m_rate = 0;
+    m_burst = 0;
+    m_tokens = 0;
+    m_last = 0;
+    m_gen = 0;
+    m_throttled = 0;
+    m_waited = 0;
+}
+
+TokenBucket::~TokenBucket()
+{
+    pthread_mutex_destroy(&m_mtx);
+}
+
+void TokenBucket::Set(long rate, long burst)
+{
+    pthread_mutex_lock(&m_mtx);
+    m_rate = rate > 0 ? rate : 0;
+    m_burst = burst > 0 ? burst : 0;
+    m_tokens = m_burst;
+    m_last = now();
+    m_gen++;
+    pthread_mutex_unlock(&m_mtx);
+}
+
+long TokenBucket::GetRate()
+{
+    long rate;
+
+    pthread_mutex_lock(&m_mtx);
+    rate = m_rate;
+    pthread_mutex_unlock(&m_mtx);
+    return rate;
+}
+
+unsigned long TokenBucket::GetGeneration()
+{
+    unsigned long gen;
+
+    pthread_mutex_lock(&m_mtx);
+    gen = m_gen;
+    pthread_mutex_unlock(&m_mtx);
+    return gen;
+}
+
+long TokenBucket::Take(long len, unsigned long *gen, bool again)
+{
+    uint64_t t;
+    long wait;
+
+    pthread_mutex_lock(&m_mtx);
+    if (gen != NULL)
+        *gen = m_gen;
+    if (m_rate == 0){
+        pthread_mutex_unlock(&m_mtx);
+        return 0;
+    }
+    t = now();
+    m_tokens += (double)(t - m_last) * m_rate / 1e9;
+    if (m_tokens > m_burst)
+        m_tokens = m_burst;
+    m_last = t;
+    m_tokens -= len;
+    wait = 0;
+    if (m_tokens < 0){
+        wait = (long)(-m_tokens * 1e6 / m_rate);
+        if (!again)
+            m_throttled++;
+        m_waited += wait;
+    }
+    pthread_mutex_unlock(&m_mtx);
+    return wait;
+}
+
+void TokenBucket::Refund(long len)
+{
+    pthread_mutex_lock(&m_mtx);
+    if (m_rate > 0){
+        m_tokens += len;
+        if (m_tokens > m_burst)
+            m_tokens = m_burst;
+    }
+    pthread_mutex_unlock(&m_mtx);
+}
+
+void TokenBucket::GetStats(unsigned long *throttled, unsigned long *waited)
+{
+    pthread_mutex_lock(&m_mtx);
+    *throttled = m_throttled;
+    *waited = m_waited;
+    pthread_mutex_unlock(&m_mtx);
+}
+
+uint64_t TokenBucket::now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,40 @@
+#ifndef PACING_H
+#define PACING_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+//Token bucket, tokens are bytes refilled at rate per second up to burst.
+//A send takes its bytes even when they are not all there yet and waits off the debt,
+//so a message is never split and one larger than burst still goes out.
+class TokenBucket
+{
+public:
+    TokenBucket();
+    ~TokenBucket();
+    //rate in bytes per second, 0 means unlimited, the bucket starts full and a new generation begins
+    void Set(long rate, long burst);
+    long GetRate();
+    unsigned long GetGeneration();
+    //take len bytes, return the time(us) to wait before sending them, 0 if they are there
+    //gen is set to the generation they were taken from, again is set when a send takes them
+    //once more after a Set, it is not counted as another throttled send
+    long Take(long len, unsigned long *gen=NULL, bool again=false);
+    //give back tokens taken for bytes that were not sent, a negative len is owed by the next send
+    void Refund(long len);
+    //sends that had to wait and the total wait(us)
+    void GetStats(unsigned long *throttled, unsigned long *waited);
+    static uint64_t now();  //CLOCK_MONOTONIC ns
+
+private:
+    pthread_mutex_t m_mtx;
+    long m_rate;
+    long m_burst;
+    double m_tokens;        //negative while in debt
+    uint64_t m_last;        //ns of the last refill
+    unsigned long m_gen;    //bumped by Set, a wait for an older one is owed to a bucket that is gone
+    unsigned long m_throttled;
+    unsigned long m_waited;
+};
+
+#endif // PACING_H
@@ -0,0 +1,397 @@
+#include "Rpc.h"
+
+//state of a CallWait, completed by waitdone
+typedef struct RPC_WAIT{
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    bool isdone;
+    int ret;
+    char *resp;
+    int resplen;
+}RW;
+
+static void waitdone(void *ctx, unsigned int, int status, char *buf, int len)
+{
+    RPC_WAIT *w = (RPC_WAIT *)ctx;
+
+    pthread_mutex_lock(&w->mtx);
+    w->ret = status;
+    if (status == RPC_OK){
+        w->ret = len < w->resplen ? len : w->resplen;
+        memcpy(w->resp, buf, w->ret);
+    }
+    w->isdone = true;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->mtx);
+}
+
+RpcChannel::RpcChannel(DataTransmit *dt)
+{
+    pthread_condattr_t attr;
+
+    m_dt = dt;
+    m_handler = NULL;
+    m_handlerctx = NULL;
+    m_nextid = 0;
+    m_isstop = false;
+    m_completed = m_timeouts = m_cancelled = 0;
+    pthread_mutex_init(&m_mtx, NULL);
+    //deadlines are monotonic
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&m_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_create(&m_ptd_timer, NULL, timer, this);
+    m_dt->SetRpcHandler(dispatch, this);
+}
+
+RpcChannel::~RpcChannel()
+{
+    std::map<unsigned int, RPC_CALL> calls;
+    void *tret;
+
+    m_dt->SetRpcHandler(NULL, NULL);
+    pthread_mutex_lock(&m_mtx);
+    m_isstop = true;
+    pthread_cond_signal(&m_cond);
+    pthread_mutex_unlock(&m_mtx);
+    pthread_join(m_ptd_timer, &tret);
+
+    calls.swap(m_calls);
+    for (auto &c : calls)
+        c.second.done(c.second.ctx, c.first, RPC_CLOSED, NULL, 0);
+    pthread_mutex_destroy(&m_mtx);
+    pthread_cond_destroy(&m_cond);
+}
+
+uint64_t RpcChannel::now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void RpcChannel::SetRequestHandler(rpc_handler_t func, void *ctx)
+{
+    pthread_mutex_lock(&m_mtx);
+    m_handler = func;
+    m_handlerctx = ctx;
+    pthread_mutex_unlock(&m_mtx);
+}
+
+//one rpc message, nowait as TrySend
+int RpcChannel::send(int kind, unsigned int id, int arg, const char *buf, int len, bool nowait)
+{
+    unsigned char head[RPC_MAX_HEAD];
+    int n, ret;
+
+    head[0] = (unsigned char)kind;
+    n = 1 + WireFormat::put_varint(head + 1, id);
+    if (kind == RK_REQUEST)
+        n += WireFormat::put_varint(head + n, arg);
+    else if (kind == RK_ERROR)
+        head[n++] = (unsigned char)-arg;
+    ret = m_dt->SendRpc((const char *)head, n, (char *)buf, len, nowait);
+    return ret < 0 ? ret : len;
+}
+
+//remove an outstanding call, false if it has already completed
+bool RpcChannel::take(unsigned int id, RPC_CALL *call)
+{
+    std::map<unsigned int, RPC_CALL>::iterator it;
+
+    pthread_mutex_lock(&m_mtx);
+    it = m_calls.find(id);
+    if (it == m_calls.end()){
+        pthread_mutex_unlock(&m_mtx);
+        return false;
+    }
+    *call = it->second;
+    m_deadlines.erase(it->second.deadline);
+    m_calls.erase(it);
+    pthread_mutex_unlock(&m_mtx);
+    return true;
+}
+
+unsigned int RpcChannel::Call(const char *buf, int len, rpc_done_t done, void *ctx, int timeout)
+{
+    RPC_CALL call;
+    unsigned int id;
+    int ret;
+
+    if (done == NULL || len < 0)
+        return 0;
+    if (timeout <= 0)
+        timeout = RPC_TIMEOUT_DEFAULT;
+
+    sendcancels();
+    //registered first, the response may arrive before SendData returns
+    pthread_mutex_lock(&m_mtx);
+    if (++m_nextid == 0)
+        ++m_nextid;
+    id = m_nextid;
+    call.done = done;
+    call.ctx = ctx;
+    call.deadline = m_deadlines.insert(std::make_pair(now() + timeout, id));
+    m_calls[id] = call;
+    if (call.deadline == m_deadlines.begin())
+        pthread_cond_signal(&m_cond);
+    pthread_mutex_unlock(&m_mtx);
+
+    ret = send(RK_REQUEST, id, timeout, buf, len);
+    //a call the timer has completed meanwhile counts as sent
+    if (ret < 0 && take(id, &call))
+        return 0;
+    return id;
+}
+
+int RpcChannel::CallWait(const char *buf, int len, char *resp, int resplen, int timeout)
+{
+    RPC_WAIT w;
+
+    pthread_mutex_init(&w.mtx, NULL);
+    pthread_cond_init(&w.cond, NULL);
+    w.isdone = false;
+    w.ret = -1;
+    w.resp = resp;
+    w.resplen = resplen;
+    if (Call(buf, len, waitdone, &w, timeout) != 0){
+        //the timer completes it at the deadline, no timed wait is needed
+        pthread_mutex_lock(&w.mtx);
+        while (!w.isdone)
+            pthread_cond_wait(&w.cond, &w.mtx);
+        pthread_mutex_unlock(&w.mtx);
+    }
+    pthread_mutex_destroy(&w.mtx);
+    pthread_cond_destroy(&w.cond);
+    return w.ret;
+}
+
+int RpcChannel::Cancel(unsigned int id)
+{
+    RPC_CALL call;
+
+    if (!take(id, &call))
+        return -1;
+    pthread_mutex_lock(&m_mtx);
+    m_cancelled++;
+    pthread_mutex_unlock(&m_mtx);
+    call.done(call.ctx, id, RPC_CANCELLED, NULL, 0);
+    //the peer only stops early, a full send buffer loses the cancel
+    sendcancels();
+    send(RK_CANCEL, id, 0, NULL, 0, true);
+    return 0;
+}
+
+int RpcChannel::Reply(unsigned int id, const char *buf, int len)
+{
+    std::map<unsigned int, DEADLINES::iterator>::iterator it;
+    bool isexpired;
+
+    pthread_mutex_lock(&m_mtx);
+    it = m_serving.find(id);
+    if (it == m_serving.end()){
+        pthread_mutex_unlock(&m_mtx);
+        return RPC_CANCELLED;
+    }
+    isexpired = it->second->first <= now();
+    m_expiry.erase(it->second);
+    m_serving.erase(it);
+    pthread_mutex_unlock(&m_mtx);
+    if (isexpired)
+        return RPC_TIMEOUT;
+    sendcancels();
+    return send(RK_RESPONSE, id, 0, buf, len);
+}
+
+//tell the peer about calls the timer completed, on the thread of a caller who may wait for room
+void RpcChannel::sendcancels()
+{
+    std::vector<unsigned int> cancels;
+
+    pthread_mutex_lock(&m_mtx);
+    cancels.swap(m_cancels);
+    pthread_mutex_unlock(&m_mtx);
+    for (auto id : cancels)
+        send(RK_CANCEL, id, 0, NULL, 0, true);
+}
+
+bool RpcChannel::IsCancelled(unsigned int id)
+{
+    std::map<unsigned int, DEADLINES::iterator>::iterator it;
+    bool ret;
+
+    pthread_mutex_lock(&m_mtx);
+    it = m_serving.find(id);
+    ret = it == m_serving.end() || it->second->first <= now();
+    pthread_mutex_unlock(&m_mtx);
+    return ret;
+}
+
+int RpcChannel::GetPending()
+{
+    int ret;
+
+    pthread_mutex_lock(&m_mtx);
+    ret = m_calls.size();
+    pthread_mutex_unlock(&m_mtx);
+    return ret;
+}
+
+void RpcChannel::GetStats(unsigned long *completed, unsigned long *timeouts, unsigned long *cancelled)
+{
+    pthread_mutex_lock(&m_mtx);
+    *completed = m_completed;
+    *timeouts = m_timeouts;
+    *cancelled = m_cancelled;
+    pthread_mutex_unlock(&m_mtx);
+}
+
+void RpcChannel::dispatch(void *ctx, const unsigned char *head, int headlen, char *buf, int len)
+{
+    if (head == NULL)
+        ((RpcChannel *)ctx)->ondisconnect();
+    else
+        ((RpcChannel *)ctx)->onmessage(head, headlen, buf, len);
+}
+
+//nothing sent on the old link is answered, and what it asked for cannot be replied to
+void RpcChannel::ondisconnect()
+{
+    std::map<unsigned int, RPC_CALL> calls;
+
+    pthread_mutex_lock(&m_mtx);
+    calls.swap(m_calls);
+    m_deadlines.clear();
+    m_serving.clear();
+    m_expiry.clear();
+    m_cancels.clear();
+    pthread_mutex_unlock(&m_mtx);
+    for (auto &c : calls)
+        c.second.done(c.second.ctx, c.first, RPC_DISCONNECTED, NULL, 0);
+}
+
+//one message with a rpc head, a head that does not parse is dropped
+void RpcChannel::onmessage(const unsigned char *head, int headlen, char *buf, int len)
+{
+    std::map<unsigned int, DEADLINES::iterator>::iterator it;
+    rpc_handler_t handler;
+    void *handlerctx;
+    RPC_CALL call;
+    unsigned int id, timeout;
+    int n, ret;
+
+    if (headlen < 2 || head[0] < RK_REQUEST || head[0] > RK_ERROR)
+        return;
+    n = 1;
+    ret = WireFormat::get_varint(head + n, headlen - n, &id);
+    if (ret <= 0)
+        return;
+    n += ret;
+
+    switch (head[0]){
+    case RK_REQUEST:
+        ret = WireFormat::get_varint(head + n, headlen - n, &timeout);
+        if (ret <= 0)
+            break;
+        n += ret;
+        pthread_mutex_lock(&m_mtx);
+        handler = m_handler;
+        handlerctx = m_handlerctx;
+        if (handler != NULL){
+            it = m_serving.find(id);
+            if (it != m_serving.end()){
+                m_expiry.erase(it->second);
+                m_serving.erase(it);
+            }
+            it = m_serving.insert(std::make_pair(id, m_expiry.insert(std::make_pair(now() + timeout, id)))).first;
+            if (it->second == m_expiry.begin())
+                pthread_cond_signal(&m_cond);
+        }
+        pthread_mutex_unlock(&m_mtx);
+        //the receive thread does not wait for room
+        if (handler == NULL)
+            send(RK_ERROR, id, RPC_NOHANDLER, NULL, 0, true);
+        else
+            handler(handlerctx, this, id, buf, len);
+        break;
+    case RK_RESPONSE:
+        //late responses of cancelled or timed out calls are dropped
+        if (!take(id, &call))
+            break;
+        pthread_mutex_lock(&m_mtx);
+        m_completed++;
+        pthread_mutex_unlock(&m_mtx);
+        call.done(call.ctx, id, RPC_OK, buf, len);
+        break;
+    case RK_ERROR:
+        if (n >= headlen || !take(id, &call))
+            break;
+        call.done(call.ctx, id, -(int)head[n], NULL, 0);
+        break;
+    case RK_CANCEL:
+        pthread_mutex_lock(&m_mtx);
+        it = m_serving.find(id);
+        if (it != m_serving.end()){
+            m_expiry.erase(it->second);
+            m_serving.erase(it);
+        }
+        pthread_mutex_unlock(&m_mtx);
+        break;
+    }
+}
+
+//completes calls past their deadline and forgets requests nobody waits for
+void *RpcChannel::timer(void *param)
+{
+    RpcChannel *rpc = (RpcChannel *)param;
+    std::vector<std::pair<unsigned int, RPC_CALL> > expired;
+    std::map<unsigned int, RPC_CALL>::iterator it;
+    struct timespec ts;
+    uint64_t t, next;
+    unsigned int id;
+
+    pthread_mutex_lock(&rpc->m_mtx);
+    while (!rpc->m_isstop){
+        t = now();
+        while (!rpc->m_deadlines.empty() && rpc->m_deadlines.begin()->first <= t){
+            id = rpc->m_deadlines.begin()->second;
+            it = rpc->m_calls.find(id);
+            expired.push_back(std::make_pair(id, it->second));
+            rpc->m_calls.erase(it);
+            rpc->m_deadlines.erase(rpc->m_deadlines.begin());
+            rpc->m_timeouts++;
+            //a write may wait for room, so the cancel goes with the next caller
+            if (rpc->m_cancels.size() < RPC_MAX_CANCELS)
+                rpc->m_cancels.push_back(id);
+        }
+        while (!rpc->m_expiry.empty() && rpc->m_expiry.begin()->first <= t){
+            rpc->m_serving.erase(rpc->m_expiry.begin()->second);
+            rpc->m_expiry.erase(rpc->m_expiry.begin());
+        }
+        if (!expired.empty()){
+            pthread_mutex_unlock(&rpc->m_mtx);
+            for (auto &e : expired)
+                e.second.done(e.second.ctx, e.first, RPC_TIMEOUT, NULL, 0);
+            expired.clear();
+            pthread_mutex_lock(&rpc->m_mtx);
+            continue;
+        }
+
+        next = 0;
+        if (!rpc->m_deadlines.empty())
+            next = rpc->m_deadlines.begin()->first;
+        if (!rpc->m_expiry.empty() && (next == 0 || rpc->m_expiry.begin()->first < next))
+            next = rpc->m_expiry.begin()->first;
+        if (next == 0){
+            pthread_cond_wait(&rpc->m_cond, &rpc->m_mtx);
+            continue;
+        }
+        ts.tv_sec = next / 1000;
+        ts.tv_nsec = (next % 1000) * 1000000;
+        pthread_cond_timedwait(&rpc->m_cond, &rpc->m_mtx, &ts);
+    }
+    pthread_mutex_unlock(&rpc->m_mtx);
+    return NULL;
+}
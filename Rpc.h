@@ -0,0 +1,107 @@
+#ifndef RPC_H
+#define RPC_H
+
+#include "DataTransmit.h"
+#include <map>
+#include <vector>
+
+//Rpc head of every rpc message, sent as the FO_RPC option of its frame
+//  kind(1) varint id [request: varint timeout(ms)] [error: status(1)]
+//the timeout is relative so the peers need no common clock
+#define RPC_MAX_HEAD 12
+#define RPC_TIMEOUT_DEFAULT 5000    //ms
+#define RPC_MAX_CANCELS 1024        //cancels waiting for a caller to send them, more are lost
+
+//Rpc message kind
+enum RPC_KIND{
+    RK_REQUEST = 1,
+    RK_RESPONSE,
+    RK_CANCEL,          //caller gave up, the peer may stop working on it
+    RK_ERROR            //request was not served, the status byte says why
+};
+
+//Call status, a completed call has RPC_OK, -1 and SEND_WOULDBLOCK keep their DataTransmit meaning
+enum RPC_STATUS{
+    RPC_OK = 0,
+    RPC_TIMEOUT = -101,
+    RPC_CANCELLED = -102,
+    RPC_NOHANDLER = -103,   //the peer has no request handler
+    RPC_CLOSED = -104,      //the channel was destroyed
+    RPC_DISCONNECTED = -105 //the link went down before the response came
+};
+
+class RpcChannel;
+
+//called once per call, buf is the response when status is RPC_OK
+typedef void (*rpc_done_t)(void *ctx, unsigned int id, int status, char *buf, int len);
+//called on the receive thread, answer with Reply now or later from any thread
+typedef void (*rpc_handler_t)(void *ctx, RpcChannel *rpc, unsigned int id, char *buf, int len);
+
+//Request/response over one DataTransmit, any number of calls may be outstanding.
+//Responses are matched by id, so they may come back in any order. Calls that
+//pass their deadline complete with RPC_TIMEOUT and the peer is told to cancel
+//with the next Call, Cancel or Reply, the timer never writes to the link.
+//A link drop completes every outstanding call with RPC_DISCONNECTED.
+//Either side may call and serve. Messages without a rpc head go to the callback function.
+//Both ends create their channel before InitialConnection and agree on it when a link comes up,
+//which takes tcp with wire format v2, so no simplify, udp or shared memory link carries rpc.
+//Destroy it after StopConnection, the receive thread may be inside it otherwise.
+class RpcChannel
+{
+public:
+    explicit RpcChannel(DataTransmit *dt);
+    ~RpcChannel();
+    void SetRequestHandler(rpc_handler_t func, void *ctx);
+    //send a request, done is called exactly once unless 0 is returned
+    //timeout in ms, 0 means RPC_TIMEOUT_DEFAULT
+    //return the call id, 0 if it was not sent(disconnected, no rpc on the link or the send buffer is full)
+    unsigned int Call(const char *buf, int len, rpc_done_t done, void *ctx, int timeout=0);
+    //blocking call, return the response length(truncated to resplen) or a RPC_STATUS
+    int  CallWait(const char *buf, int len, char *resp, int resplen, int timeout=0);
+    //complete the call with RPC_CANCELLED now, return -1 if it has already completed
+    int  Cancel(unsigned int id);
+    //answer a request, return len, -1 if it was not sent,
+    //RPC_CANCELLED or RPC_TIMEOUT if the caller is no longer waiting
+    int  Reply(unsigned int id, const char *buf, int len);
+    //true once the caller cancelled the request or its deadline passed
+    bool IsCancelled(unsigned int id);
+    int  GetPending();
+    void GetStats(unsigned long *completed, unsigned long *timeouts, unsigned long *cancelled);
+
+private:
+    typedef std::multimap<uint64_t, unsigned int> DEADLINES;
+
+    typedef struct RPC_CALL{
+        rpc_done_t done;
+        void *ctx;
+        DEADLINES::iterator deadline;
+    }RC;
+
+    DataTransmit *m_dt;
+    rpc_handler_t m_handler;
+    void *m_handlerctx;
+    unsigned int m_nextid;
+    bool m_isstop;
+    std::map<unsigned int, RPC_CALL> m_calls;           //outstanding calls
+    DEADLINES m_deadlines;
+    std::map<unsigned int, DEADLINES::iterator> m_serving;  //requests being served
+    DEADLINES m_expiry;
+    std::vector<unsigned int> m_cancels;    //timed out calls the peer is not told about yet
+    unsigned long m_completed;
+    unsigned long m_timeouts;
+    unsigned long m_cancelled;
+    pthread_mutex_t m_mtx;
+    pthread_cond_t m_cond;
+    pthread_t m_ptd_timer;
+
+    int  send(int kind, unsigned int id, int arg, const char *buf, int len, bool nowait=false);
+    bool take(unsigned int id, RPC_CALL *call);
+    void sendcancels();
+    void onmessage(const unsigned char *head, int headlen, char *buf, int len);
+    void ondisconnect();
+    static void dispatch(void *ctx, const unsigned char *head, int headlen, char *buf, int len);
+    static void *timer(void *param);
+    static uint64_t now();
+};
+
+#endif // RPC_H
@@ -0,0 +1,324 @@
+#include "ShmRing.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+ShmRing::ShmRing()
+{
+    m_seg = NULL;
+    m_tx = m_rx = NULL;
+    m_txdata = m_rxdata = NULL;
+    m_size = m_mask = m_maxrec = 0;
+    m_maplen = 0;
+    m_spin = 0;
+    m_iscreator = false;
+    m_isstop = false;
+    m_dropped = 0;
+    m_name[0] = 0;
+}
+
+ShmRing::~ShmRing()
+{
+    detach();
+}
+
+void ShmRing::futex_wait(std::atomic<uint32_t> *addr, uint32_t val)
+{
+    //not FUTEX_PRIVATE, the word is shared with another process
+    syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+void ShmRing::futex_wake(std::atomic<uint32_t> *addr)
+{
+    addr->fetch_add(1);
+    syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+int ShmRing::create(int ringsize)
+{
+    static std::atomic<unsigned int> counter(0);
+    uint32_t size;
+    int fd, ret;
+
+    detach();
+    size = 64*1024;
+    while (size < (uint32_t)ringsize && size < 0x40000000)
+        size <<= 1;
+    snprintf(m_name, sizeof(m_name), "/datatransmit-%d-%u", getpid(), counter++);
+
+    fd = shm_open(m_name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0){
+        perror("shm_open");
+        return -1;
+    }
+    m_size = size;
+    m_maplen = sizeof(SS) + 2 * (size_t)size;
+    if (ftruncate(fd, m_maplen) < 0){
+        perror("ftruncate");
+        close(fd);
+        shm_unlink(m_name);
+        return -2;
+    }
+    ret = mapseg(fd, true);
+    close(fd);
+    if (ret < 0){
+        shm_unlink(m_name);
+        return -3;
+    }
+    return 0;
+}
+
+int ShmRing::attach(const char *name)
+{
+    struct stat st;
+    int fd, ret;
+
+    detach();
+    strncpy(m_name, name, sizeof(m_name) - 1);
+    m_name[sizeof(m_name) - 1] = 0;
+    fd = shm_open(m_name, O_RDWR, 0600);
+    if (fd < 0){
+        perror("shm_open");
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SS)){
+        close(fd);
+        return -2;
+    }
+    m_maplen = st.st_size;
+    ret = mapseg(fd, false);
+    close(fd);
+    if (ret < 0)
+        return -3;
+    return 0;
+}
+
+int ShmRing::mapseg(int fd, bool creator)
+{
+    void *addr;
+
+    addr = mmap(NULL, m_maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED){
+        perror("mmap");
+        return -1;
+    }
+    m_seg = (PSS)addr;
+    if (creator){
+        memset((void *)m_seg, 0, sizeof(SS));
+        m_seg->ringsize = m_size;
+        m_seg->magic = SHM_MAGIC;
+    }
+    else{
+        m_size = m_seg->ringsize;
+        if (m_seg->magic != SHM_MAGIC || (m_size & (m_size - 1)) || m_maplen < sizeof(SS) + 2 * (size_t)m_size){
+            munmap(addr, m_maplen);
+            m_seg = NULL;
+            return -2;
+        }
+    }
+    m_iscreator = creator;
+    m_mask = m_size - 1;
+    m_maxrec = m_size / 4;
+    m_tx = &m_seg->ring[creator ? 0 : 1];
+    m_rx = &m_seg->ring[creator ? 1 : 0];
+    m_txdata = (char *)(m_seg + 1) + (creator ? 0 : m_size);
+    m_rxdata = (char *)(m_seg + 1) + (creator ? m_size : 0);
+    m_isstop = false;
+    return 0;
+}
+
+void ShmRing::unlink()
+{
+    if (m_name[0])
+        shm_unlink(m_name);
+}
+
+void ShmRing::detach()
+{
+    if (m_seg == NULL)
+        return;
+    //let the peer see we are gone, then wake it up from both directions
+    m_tx->closed = 1;
+    futex_wake(&m_tx->dataseq);
+    futex_wake(&m_rx->spaceseq);
+    if (m_iscreator)
+        unlink();
+    munmap(m_seg, m_maplen);
+    m_seg = NULL;
+    m_tx = m_rx = NULL;
+    m_name[0] = 0;
+}
+
+void ShmRing::wakeup()
+{
+    m_isstop = true;
+    if (m_seg == NULL)
+        return;
+    futex_wake(&m_rx->dataseq);
+    futex_wake(&m_tx->spaceseq);
+}
+
+void ShmRing::set_spin(int spin)
+{
+    //spinning only burns the time slice the peer needs on a single cpu
+    m_spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? spin : 0;
+}
+
+bool ShmRing::is_attached()
+{
+    return m_seg != NULL;
+}
+
+const char *ShmRing::name()
+{
+    return m_name;
+}
+
+//wait until need bytes are free in the tx ring, spinning first if configured
+bool ShmRing::waitspace(uint32_t need)
+{
+    uint32_t head, seq;
+    int spin;
+
+    head = m_tx->head.load(std::memory_order_relaxed);
+    spin = 0;
+    while (m_size - (head - m_tx->tail.load(std::memory_order_acquire)) < need){
+        if (m_isstop || m_rx->closed)
+            return false;
+        if (spin < m_spin){
+            spin++;
+            cpu_relax();
+            continue;
+        }
+        seq = m_tx->spaceseq.load();
+        m_tx->spacewait.store(1);
+        if (m_size - (head - m_tx->tail.load()) < need && !m_isstop)
+            futex_wait(&m_tx->spaceseq, seq);
+        m_tx->spacewait.store(0);
+    }
+    return true;
+}
+
+int ShmRing::write(const char *buf, int len, bool nowait)
+{
+    SRH *rec;
+    uint32_t head, pos, left, need, fraglen, off;
+
+    if (m_seg == NULL || m_isstop || m_rx->closed)
+        return -1;
+    if (nowait){
+        //worst case: a wrap record plus the padded header of every fragment
+        need = len + (len / m_maxrec + 1) * (sizeof(SRH) + 8) + m_maxrec + sizeof(SRH);
+        head = m_tx->head.load(std::memory_order_relaxed);
+        if (m_size - (head - m_tx->tail.load(std::memory_order_acquire)) < need)
+            return -2;
+    }
+
+    off = 0;
+    do{
+        fraglen = (uint32_t)len - off;
+        if (fraglen > m_maxrec)
+            fraglen = m_maxrec;
+        need = sizeof(SRH) + ((fraglen + 7) & ~7u);
+        head = m_tx->head.load(std::memory_order_relaxed);
+        pos = head & m_mask;
+        left = m_size - pos;
+        if (left < need){
+            if (!waitspace(left))
+                return -1;
+            rec = (SRH *)(m_txdata + pos);
+            rec->len = 0;
+            rec->flag = SHM_REC_WRAP;
+            head += left;
+            pos = 0;
+        }
+        if (!waitspace(head - m_tx->head.load(std::memory_order_relaxed) + need))
+            return -1;
+        rec = (SRH *)(m_txdata + pos);
+        rec->len = fraglen;
+        rec->flag = off + fraglen < (uint32_t)len ? SHM_REC_MORE : 0;
+        memcpy(rec + 1, buf + off, fraglen);
+        off += fraglen;
+
+        m_tx->head.store(head + need);
+        if (m_tx->datawait.load())
+            futex_wake(&m_tx->dataseq);
+    }while (off < (uint32_t)len);
+
+    return len;
+}
+
+int ShmRing::read(char *buf, int maxlen)
+{
+    SRH *rec;
+    uint32_t tail, seq;
+    int total, spin;
+    bool more, skip;
+
+    if (m_seg == NULL)
+        return -1;
+    total = 0;
+    skip = false;
+    while (true){
+        tail = m_rx->tail.load(std::memory_order_relaxed);
+        spin = 0;
+        while (m_rx->head.load(std::memory_order_acquire) == tail){
+            if (m_isstop || m_rx->closed)
+                return -1;
+            if (spin < m_spin){
+                spin++;
+                cpu_relax();
+                continue;
+            }
+            seq = m_rx->dataseq.load();
+            m_rx->datawait.store(1);
+            if (m_rx->head.load() == tail && !m_isstop && !m_rx->closed)
+                futex_wait(&m_rx->dataseq, seq);
+            m_rx->datawait.store(0);
+        }
+
+        rec = (SRH *)(m_rxdata + (tail & m_mask));
+        if (rec->flag & SHM_REC_WRAP){
+            tail += m_size - (tail & m_mask);
+            more = true;
+        }
+        else{
+            //a message longer than the buffer is dropped as a whole, the writer should have refused it
+            if (!skip && total + (int)rec->len <= maxlen)
+                memcpy(buf + total, rec + 1, rec->len);
+            else
+                skip = true;
+            total += rec->len;
+            more = rec->flag & SHM_REC_MORE;
+            tail += sizeof(SRH) + ((rec->len + 7) & ~7u);
+        }
+
+        m_rx->tail.store(tail);
+        if (m_rx->spacewait.load())
+            futex_wake(&m_rx->spaceseq);
+        if (!more){
+            if (!skip)
+                return total;
+            m_dropped++;
+            total = 0;
+            skip = false;
+        }
+    }
+}
+
+unsigned long ShmRing::dropped()
+{
+    return m_dropped;
+}
@@ -0,0 +1,82 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <atomic>
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHM_MAGIC 0x44545348    //"DTSH"
+#define SHM_CACHELINE 64
+#define SHM_NAME_LEN 64
+
+//Record flags
+#define SHM_REC_MORE 0x1        //message continues in the next record
+#define SHM_REC_WRAP 0x2        //skip to the beginning of the ring
+
+//One direction of the segment, single producer single consumer.
+//head and tail are free running counters, the index is pos & (size-1).
+typedef struct SHM_RING{
+    std::atomic<uint32_t> head;         //written by producer only
+    char pad0[SHM_CACHELINE - 4];
+    std::atomic<uint32_t> tail;         //written by consumer only
+    char pad1[SHM_CACHELINE - 4];
+    std::atomic<uint32_t> dataseq;      //futex word, bumped when data is published to a sleeping consumer
+    std::atomic<uint32_t> datawait;     //consumer is going to sleep
+    std::atomic<uint32_t> spaceseq;     //futex word, bumped when space is freed for a sleeping producer
+    std::atomic<uint32_t> spacewait;    //producer is going to sleep
+    std::atomic<uint32_t> closed;       //producer detached
+    char pad2[SHM_CACHELINE - 20];
+}SR, *PSR;
+
+typedef struct SHM_REC{
+    uint32_t len;
+    uint32_t flag;
+}SRH;
+
+typedef struct SHM_SEG{
+    uint32_t magic;
+    uint32_t ringsize;
+    char pad[SHM_CACHELINE - 8];
+    SR ring[2];                         //0: connector to listener, 1: listener to connector
+}SS, *PSS;
+
+class ShmRing
+{
+public:
+    ShmRing();
+    ~ShmRing();
+    int  create(int ringsize);          //return 0 on success, name() can be sent to the peer
+    int  attach(const char *name);      //open the segment created by the peer
+    void unlink();                      //remove the name once both sides are attached
+    void detach();
+    void wakeup();                      //wake up local blocked read/write, they return -1
+    void set_spin(int spin);
+    bool is_attached();
+    const char *name();
+    int  write(const char *buf, int len, bool nowait);  //return len, -2 when full and nowait, -1 closed
+    int  read(char *buf, int maxlen);   //block until a whole message arrives, return len or -1 closed
+    unsigned long dropped();            //messages longer than maxlen that read skipped
+
+private:
+    PSS  m_seg;
+    PSR  m_tx;
+    PSR  m_rx;
+    char *m_txdata;
+    char *m_rxdata;
+    uint32_t m_size;
+    uint32_t m_mask;
+    uint32_t m_maxrec;
+    size_t m_maplen;
+    int  m_spin;
+    bool m_iscreator;
+    std::atomic<bool> m_isstop;
+    std::atomic<unsigned long> m_dropped;
+    char m_name[SHM_NAME_LEN];
+
+    int  mapseg(int fd, bool creator);
+    bool waitspace(uint32_t need);
+    static void futex_wait(std::atomic<uint32_t> *addr, uint32_t val);
+    static void futex_wake(std::atomic<uint32_t> *addr);
+};
+
+#endif // SHMRING_H
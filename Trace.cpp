@@ -0,0 +1,156 @@
+#include "Trace.h"
+#include <time.h>
+
+Histogram::Histogram()
+{
+    Reset();
+}
+
+//values below 8 have a bucket each, above that a power of two is split in 8
+int Histogram::bucket(uint64_t ns)
+{
+    int e;
+
+    if (ns < (1 << HIST_SUB_BITS))
+        return (int)ns;
+    e = 63 - __builtin_clzll(ns);
+    return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) | (int)((ns >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+uint64_t Histogram::upper(int b)
+{
+    int g, sub;
+
+    if (b < (1 << HIST_SUB_BITS))
+        return b;
+    g = b >> HIST_SUB_BITS;
+    sub = b & ((1 << HIST_SUB_BITS) - 1);
+    return (((uint64_t)((1 << HIST_SUB_BITS) + sub + 1)) << (g - 1)) - 1;
+}
+
+void Histogram::Add(uint64_t ns)
+{
+    uint64_t max;
+
+    m_buckets[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    max = m_max.load(std::memory_order_relaxed);
+    while (ns > max && !m_max.compare_exchange_weak(max, ns, std::memory_order_relaxed))
+        ;
+}
+
+void Histogram::Reset()
+{
+    int i;
+
+    for (i=0; i<HIST_BUCKETS; i++)
+        m_buckets[i] = 0;
+    m_count = 0;
+    m_max = 0;
+}
+
+unsigned long Histogram::Count()
+{
+    return m_count;
+}
+
+uint64_t Histogram::Max()
+{
+    return m_max;
+}
+
+uint64_t Histogram::Percentile(double p)
+{
+    unsigned long count, rank, seen;
+    uint64_t val;
+    int i;
+
+    count = m_count;
+    if (count == 0)
+        return 0;
+    rank = (unsigned long)(count * p / 100.0);
+    if (rank >= count)
+        rank = count - 1;
+    seen = 0;
+    for (i=0; i<HIST_BUCKETS; i++){
+        seen += m_buckets[i].load(std::memory_order_relaxed);
+        if (seen > rank){
+            val = upper(i);
+            return val < m_max ? val : m_max.load();
+        }
+    }
+    return m_max;
+}
+
+Tracer::Tracer()
+{
+    m_skewed = 0;
+}
+
+uint64_t Tracer::now()
+{
+    struct timespec ts;
+
+    //same clock as the SO_TIMESTAMPING software stamps
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+const char *Tracer::name(int stage)
+{
+    static const char *names[TS_COUNT] = {
+        "call", "encode", "write", "wire", "wakeup", "decode", "dispatch", "callback", "oneway"
+    };
+
+    if (stage < 0 || stage >= TS_COUNT)
+        return "unknown";
+    return names[stage];
+}
+
+void Tracer::Add(int stage, uint64_t from, uint64_t to)
+{
+    if (stage < 0 || stage >= TS_COUNT || from == 0 || to == 0)
+        return;
+    if (to < from){
+        m_skewed++;
+        return;
+    }
+    m_hist[stage].Add(to - from);
+}
+
+void Tracer::Reset()
+{
+    int i;
+
+    for (i=0; i<TS_COUNT; i++)
+        m_hist[i].Reset();
+    m_skewed = 0;
+}
+
+Histogram *Tracer::Get(int stage)
+{
+    if (stage < 0 || stage >= TS_COUNT)
+        return NULL;
+    return &m_hist[stage];
+}
+
+unsigned long Tracer::GetSkewed()
+{
+    return m_skewed;
+}
+
+void Tracer::Print(FILE *fp)
+{
+    int i;
+
+    fprintf(fp, "%-10s %10s %10s %10s %10s %10s\n", "stage", "count", "p50(us)", "p99(us)", "p99.9(us)", "max(us)");
+    for (i=0; i<TS_COUNT; i++){
+        if (m_hist[i].Count() == 0)
+            continue;
+        fprintf(fp, "%-10s %10lu %10.1f %10.1f %10.1f %10.1f\n", name(i), m_hist[i].Count(),
+                m_hist[i].Percentile(50) / 1000.0, m_hist[i].Percentile(99) / 1000.0,
+                m_hist[i].Percentile(99.9) / 1000.0, m_hist[i].Max() / 1000.0);
+    }
+    if (m_skewed > 0)
+        fprintf(fp, "%lu stamps dropped for clock skew\n", m_skewed.load());
+}
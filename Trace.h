@@ -0,0 +1,64 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+
+//Histogram buckets are log-linear, 8 linear steps per power of two(about 12% resolution)
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+//Trace stage, stamps are CLOCK_REALTIME so one-way stages between hosts need synchronized clocks
+enum TRACE_STAGE{
+    TS_CALL = 0,        //sender: time spent in SendData
+    TS_ENCODE,          //sender: SendData entry to encode done
+    TS_WRITE,           //sender: encode done to write done, includes the non-blocking send buffer
+    TS_WIRE,            //receiver: encode done to kernel rx timestamp
+    TS_WAKEUP,          //receiver: kernel rx timestamp to recv return
+    TS_DECODE,          //receiver: recv return to decode done
+    TS_DISPATCH,        //receiver: decode done to callback start
+    TS_CALLBACK,        //receiver: callback start to callback end
+    TS_ONEWAY,          //SendData entry to callback start
+    TS_COUNT
+};
+
+class Histogram
+{
+public:
+    Histogram();
+    void Add(uint64_t ns);
+    void Reset();
+    unsigned long Count();
+    uint64_t Max();
+    //upper bound of the bucket holding the p-th percentile(0-100)
+    uint64_t Percentile(double p);
+
+private:
+    std::atomic<unsigned long> m_buckets[HIST_BUCKETS];
+    std::atomic<unsigned long> m_count;
+    std::atomic<uint64_t> m_max;
+
+    static int bucket(uint64_t ns);
+    static uint64_t upper(int b);
+};
+
+class Tracer
+{
+public:
+    Tracer();
+    //negative durations come from clock skew between hosts, they are counted and dropped
+    void Add(int stage, uint64_t from, uint64_t to);
+    void Reset();
+    Histogram *Get(int stage);
+    unsigned long GetSkewed();
+    void Print(FILE *fp);
+    static uint64_t now();
+    static const char *name(int stage);
+
+private:
+    Histogram m_hist[TS_COUNT];
+    std::atomic<unsigned long> m_skewed;
+};
+
+#endif // TRACE_H
@@ -0,0 +1,448 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include "CmnHdr.h"
+#include "WireFormat.h"
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <atomic>
+#include <vector>
+
+//Transport is put together from policy classes at compile time, every data message
+//goes through inlined policy calls instead of checking the connection flags.
+//DataTransmit picks one of the typedefs at the bottom when a link comes up.
+
+//Socket policy
+struct StreamSocket
+{
+    static const bool datagram = false;
+
+    //send the whole buffer, return len or -1
+    static inline int write(int sock, const struct sockaddr_in *, const char *buf, int len)
+    {
+        int sendbytes, totalbytes;
+
+        totalbytes = 0;
+        while (totalbytes < len){
+            sendbytes = send(sock, buf+totalbytes, len-totalbytes, MSG_NOSIGNAL);
+            if (sendbytes < 0){
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            totalbytes += sendbytes;
+        }
+        return len;
+    }
+
+    static inline int read(int sock, char *buf, int len, struct sockaddr_in *)
+    {
+        return recv(sock, buf, len, 0);
+    }
+};
+
+struct DatagramSocket
+{
+    static const bool datagram = true;
+
+    //one datagram, to is NULL on a connected socket
+    static inline int write(int sock, const struct sockaddr_in *to, const char *buf, int len)
+    {
+        int ret;
+
+        do{
+            ret = sendto(sock, buf, len, 0, (const struct sockaddr *)to, to ? sizeof(*to) : 0);
+        }while (ret < 0 && errno == EINTR);
+        return ret < 0 ? -1 : len;
+    }
+
+    static inline int read(int sock, char *buf, int len, struct sockaddr_in *from)
+    {
+        socklen_t addrlen = sizeof(*from);
+
+        if (from == NULL)
+            return recv(sock, buf, len, MSG_DONTWAIT);
+        return recvfrom(sock, buf, len, MSG_DONTWAIT, (struct sockaddr *)from, &addrlen);
+    }
+};
+
+//Framing policy
+struct RawFraming
+{
+    static const bool framed = false;   //a message is the bytes of one send or recv
+
+    static inline int head(unsigned char *, int, int, int, unsigned int, unsigned int,
+                           const unsigned char *, const unsigned char *, int)
+    {
+        return 0;
+    }
+};
+
+struct BlockFraming
+{
+    static const bool framed = true;    //BLOCK_HEAD or wire format v2 frames
+
+    //write the head of a frame in wire format ver, return its length
+    //v1 has data and control frames only, its heartbeat is a fixed string and options are dropped
+    static inline int head(unsigned char *out, int kind, int ver, int flags, unsigned int len, unsigned int chksum,
+                           const unsigned char *sign, const unsigned char *opts, int optlen)
+    {
+        if (ver >= 2)
+            return WireFormat::encode_head(out, kind, flags, len, chksum, opts, optlen);
+        switch (kind){
+        case FK_DATA:
+            return WireFormat::encode_head_v1(out, sign, len, 0, chksum);
+        case FK_CONTROL:
+            //inverted checksum, v1 peers drop control frames as corrupted
+            return WireFormat::encode_head_v1(out, sign, len, BH_FLAG_CONTROL, ~chksum);
+        default:
+            memcpy(out, HEARTBEAT_V1, HEARTBEAT_V1_LEN);
+            return HEARTBEAT_V1_LEN;
+        }
+    }
+};
+
+//Cipher policy
+struct Rc4Cipher
+{
+    static const int flag = FF_CRYPT;
+
+    static inline void apply(const unsigned char *pkey, const unsigned char *pin, unsigned char *pout, unsigned int len)
+    {
+        unsigned char S[256],K[256],temp;
+        unsigned int  i,j,t,x;
+
+        j = 1;
+        for(i=0;i<256;i++)
+        {
+            S[i] = (unsigned char)i;
+            if(j > 16) j = 1;
+            K[i] = pkey[j-1];
+            j++;
+        }
+        j = 0;
+        for(i=0;i<256;i++)
+        {
+            j = (j + S[i] + K[i]) % 256;
+            temp = S[i];
+            S[i] = S[j];
+            S[j] = temp;
+        }
+        i = j = 0;
+        for(x=0;x<len;x++)
+        {
+            i = (i+1) % 256;
+            j = (j + S[i]) % 256;
+            temp = S[i];
+            S[i] = S[j];
+            S[j] = temp;
+            t = (S[i] + (S[j] % 256)) % 256;
+            pout[x] = pin[x] ^ S[t];
+        }
+    }
+};
+
+struct NoCipher
+{
+    static const int flag = 0;
+
+    static inline void apply(const unsigned char *, const unsigned char *pin, unsigned char *pout, unsigned int len)
+    {
+        if (pout != pin)
+            memcpy(pout, pin, len);
+    }
+};
+
+//Checksum policy
+struct Crc32Checksum
+{
+    static const int flag = FF_CRC;
+
+    //crc32 without the final xor, as BLOCK_HEAD has always carried it
+    static inline unsigned int compute(const unsigned char *buffer, unsigned int size)
+    {
+        const unsigned int *crc_table = table();
+        unsigned int crc = 0xffffffff;
+        unsigned int i;
+
+        for(i=0; i<size; i++)
+            crc = crc_table[(crc^buffer[i])&0xff]^(crc>>8);
+        return crc;
+    }
+
+    static inline const unsigned int *table()
+    {
+        static const CrcTable crc_table;
+        return crc_table.v;
+    }
+
+private:
+    struct CrcTable{
+        unsigned int v[256];
+        CrcTable()
+        {
+            unsigned int c;
+            unsigned int i,j;
+
+            for(i=0; i<256; i++)
+            {
+                c = i;
+                for(j=0; j<8; j++)
+                {
+                    if(c & 1)
+                        c = 0xedb88320L ^ (c>>1);
+                    else
+                        c = c >> 1;
+                }
+                v[i] = c;
+            }
+        }
+    };
+};
+
+struct NoChecksum
+{
+    static const int flag = 0;
+
+    static inline unsigned int compute(const unsigned char *, unsigned int)
+    {
+        return 0;
+    }
+};
+
+template<class Socket, class Framing, class Cipher, class Checksum>
+class Transport
+{
+public:
+    typedef Socket socket_type;
+    typedef Framing framing_type;
+    typedef Cipher cipher_type;
+    typedef Checksum checksum_type;
+
+    //encode one data message in wire format ver, out must have room for len + FRAME_MAX_HEAD bytes
+    //a raw transport copies the message as it is
+    static inline int encode(char *out, const char *buf, int len, int ver, const unsigned char *sign,
+                             const unsigned char *key, const unsigned char *opts=NULL, int optlen=0)
+    {
+        unsigned char *pout = (unsigned char *)out;
+        unsigned int chksum;
+        int n;
+
+        chksum = Checksum::compute((const unsigned char *)buf, len);
+        n = Framing::head(pout, FK_DATA, ver, Checksum::flag | Cipher::flag, len, chksum, sign, opts, optlen);
+        Cipher::apply(key, (const unsigned char *)buf, pout + n, len);
+        return n + len;
+    }
+
+    //encode a heartbeat, ack or control frame, their payload is sent in the clear
+    //a raw transport has no such frames and returns 0
+    static inline int frame(char *out, int kind, const char *buf, int len, int ver, const unsigned char *sign)
+    {
+        unsigned char *pout = (unsigned char *)out;
+        unsigned int chksum;
+        int n;
+
+        if (!Framing::framed)
+            return 0;
+        chksum = len > 0 ? Checksum::compute((const unsigned char *)buf, len) : 0;
+        n = Framing::head(pout, kind, ver, len > 0 ? Checksum::flag : 0, len, chksum, sign, NULL, 0);
+        if (len > 0)
+            memcpy(out + n, buf, len);
+        return n + len;
+    }
+
+    //decipher and check a decoded data frame, return the plain message or NULL if it is corrupted
+    //the frame flags come from the peer, a policy only handles what it knows
+    static inline char *open(const FRAME_INFO *fi, char *payload, char *outbuf, const unsigned char *key)
+    {
+        char *plain = payload;
+
+        if (fi->flags & FF_CRYPT){
+            if (Cipher::flag != FF_CRYPT)
+                return NULL;
+            Cipher::apply(key, (const unsigned char *)payload, (unsigned char *)outbuf, fi->len);
+            plain = outbuf;
+        }
+        if ((fi->flags & FF_CRC) && Checksum::flag == FF_CRC &&
+            fi->chksum != Checksum::compute((const unsigned char *)plain, fi->len))
+            return NULL;
+        return plain;
+    }
+
+    //check a decoded frame of any kind, return its plain payload or NULL if it is corrupted
+    //control frames are sent in the clear, v1 carries their checksum inverted
+    static inline char *check(const FRAME_INFO *fi, char *payload, char *outbuf, const unsigned char *key)
+    {
+        unsigned int chksum;
+
+        switch (fi->kind){
+        case FK_DATA:
+            return open(fi, payload, outbuf, key);
+        case FK_CONTROL:
+            if (fi->len == 0)
+                return NULL;
+            if ((fi->flags & FF_CRC) && Checksum::flag == FF_CRC){
+                chksum = Checksum::compute((const unsigned char *)payload, fi->len);
+                if (fi->chksum != (fi->version < 2 ? ~chksum : chksum))
+                    return NULL;
+            }
+            return payload;
+        default:
+            return payload;
+        }
+    }
+
+    static inline int write(int sock, const struct sockaddr_in *to, const char *buf, int len)
+    {
+        return Socket::write(sock, to, buf, len);
+    }
+
+    static inline int read(int sock, char *buf, int len, struct sockaddr_in *from)
+    {
+        return Socket::read(sock, buf, len, from);
+    }
+};
+
+//Cuts a framed byte stream into checked frames, v1 and v2 frames may be mixed.
+//After corruption resync looks for the next frame start. A candidate counts only once it passes
+//its checksum: an incomplete one holds back the bytes after it only while none of them starts a
+//valid frame, and one that fails is given up for the byte right after its start.
+template<class T>
+class FrameDecoder
+{
+public:
+    //resyncs and skipped bytes are added to the caller's counters
+    FrameDecoder(const unsigned char *sign, const unsigned char *key, int maxlen,
+                 std::atomic<unsigned long> *resyncs, std::atomic<unsigned long> *skipped)
+        : m_sign(sign), m_key(key), m_maxlen(maxlen), m_unverified(false), m_scanned(1), m_resyncs(resyncs), m_skipped(skipped)
+    {
+        m_outbuf = T::framing_type::framed ? (char *)malloc(maxlen) : NULL;
+    }
+
+    ~FrameDecoder()
+    {
+        free(m_outbuf);
+    }
+
+    //call f(fi, plain) for every valid frame at the front of buf, return the bytes used,
+    //the rest is the start of a frame and is passed again with more bytes behind it
+    template<class F>
+    int decode(char *buf, int len, F f)
+    {
+        FRAME_INFO fi;
+        char *plain;
+        int off, ret, skip;
+        bool incomplete;
+
+        off = 0;
+        while (off < len){
+            ret = WireFormat::decode((const unsigned char *)buf+off, len-off, m_sign, m_maxlen, &fi);
+            if (ret == 0 && m_unverified){
+                skip = rescan(buf+off, len-off, &incomplete);
+                if (incomplete || skip == len-off)
+                    break;
+                //a valid frame follows, the candidate was none
+                *m_skipped += skip;
+                off += skip;
+                m_unverified = false;
+                continue;
+            }
+            if (ret == 0)
+                break;
+            if (ret > 0){
+                plain = verify(&fi, buf+off+fi.hdrlen);
+                if (plain != NULL){
+                    m_unverified = false;
+                    off += ret;
+                    f(&fi, plain);
+                    continue;
+                }
+            }
+            //not a frame, or one that fails its checksum, frames inside it are found again
+            skip = find(buf+off, len-off, &m_unverified);
+            (*m_resyncs)++;
+            *m_skipped += skip;
+            off += skip;
+        }
+        return off;
+    }
+
+private:
+    const unsigned char *m_sign;
+    const unsigned char *m_key;
+    int m_maxlen;
+    char *m_outbuf;
+    bool m_unverified;      //the frame at the front was found by resync and is still incomplete
+    int m_scanned;          //resync has looked at the bytes of the front frame before this offset
+    std::vector<int> m_pending;     //incomplete candidates before m_scanned, in order
+    std::atomic<unsigned long> *m_resyncs;
+    std::atomic<unsigned long> *m_skipped;
+
+    //a frame without a checksum cannot be told from noise, only an empty one is taken
+    char *verify(const FRAME_INFO *fi, char *payload)
+    {
+        if (fi->len > 0 && !(fi->flags & FF_CRC))
+            return NULL;
+        return T::check(fi, payload, m_outbuf, m_key);
+    }
+
+    //offset of the next frame start after buf[0]: the first complete candidate that verifies,
+    //else the first incomplete one(*incomplete is set), else len
+    int find(char *buf, int len, bool *incomplete)
+    {
+        m_scanned = 1;
+        m_pending.clear();
+        return rescan(buf, len, incomplete);
+    }
+
+    //find again with more bytes behind the same buf[0], only the incomplete candidates
+    //and the new bytes are looked at, rejected candidates stay rejected
+    int rescan(char *buf, int len, bool *incomplete)
+    {
+        FRAME_INFO fi;
+        int pos, ret;
+        size_t i;
+
+        for (i=0; i<m_pending.size(); ){
+            pos = m_pending[i];
+            ret = WireFormat::decode((const unsigned char *)buf+pos, len-pos, m_sign, m_maxlen, &fi);
+            if (ret > 0 && verify(&fi, buf+pos+fi.hdrlen) != NULL){
+                *incomplete = false;
+                return pos;
+            }
+            if (ret == 0)
+                i++;
+            else
+                m_pending.erase(m_pending.begin() + i);
+        }
+        pos = m_scanned;
+        while (pos < len){
+            pos += WireFormat::scan((const unsigned char *)buf+pos, len-pos, m_sign);
+            if (pos >= len)
+                break;
+            ret = WireFormat::decode((const unsigned char *)buf+pos, len-pos, m_sign, m_maxlen, &fi);
+            if (ret > 0 && verify(&fi, buf+pos+fi.hdrlen) != NULL){
+                *incomplete = false;
+                return pos;
+            }
+            if (ret == 0)
+                m_pending.push_back(pos);
+            pos++;
+        }
+        m_scanned = len;
+        *incomplete = !m_pending.empty();
+        return m_pending.empty() ? len : m_pending[0];
+    }
+};
+
+//Common instantiations, simplify is the raw one
+typedef Transport<StreamSocket, BlockFraming, Rc4Cipher, Crc32Checksum> TcpTransport;
+typedef Transport<StreamSocket, RawFraming, NoCipher, NoChecksum> TcpRawTransport;
+typedef Transport<DatagramSocket, BlockFraming, Rc4Cipher, Crc32Checksum> UdpTransport;
+typedef Transport<DatagramSocket, RawFraming, NoCipher, NoChecksum> UdpRawTransport;
+
+#endif // TRANSPORT_H
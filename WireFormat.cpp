@@ -0,0 +1,362 @@
+#include "WireFormat.h"
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+typedef int (*scan_t)(const unsigned char *buf, int len, unsigned char a, unsigned char b, unsigned char c);
+
+static int scan_scalar(const unsigned char *buf, int len, unsigned char a, unsigned char b, unsigned char c)
+{
+    int i;
+
+    for (i=0; i<len; i++){
+        if (buf[i] == a || buf[i] == b || buf[i] == c)
+            break;
+    }
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static int scan_sse2(const unsigned char *buf, int len, unsigned char a, unsigned char b, unsigned char c)
+{
+    __m128i va = _mm_set1_epi8((char)a);
+    __m128i vb = _mm_set1_epi8((char)b);
+    __m128i vc = _mm_set1_epi8((char)c);
+    __m128i v;
+    unsigned int mask;
+    int i;
+
+    for (i=0; i+16<=len; i+=16){
+        v = _mm_loadu_si128((const __m128i *)(buf+i));
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)),
+                                              _mm_cmpeq_epi8(v, vc)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + scan_scalar(buf+i, len-i, a, b, c);
+}
+
+__attribute__((target("avx2")))
+static int scan_avx2(const unsigned char *buf, int len, unsigned char a, unsigned char b, unsigned char c)
+{
+    __m256i va = _mm256_set1_epi8((char)a);
+    __m256i vb = _mm256_set1_epi8((char)b);
+    __m256i vc = _mm256_set1_epi8((char)c);
+    __m256i v;
+    unsigned int mask;
+    int i;
+
+    for (i=0; i+32<=len; i+=32){
+        v = _mm256_loadu_si256((const __m256i *)(buf+i));
+        mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)),
+                                                    _mm256_cmpeq_epi8(v, vc)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + scan_sse2(buf+i, len-i, a, b, c);
+}
+
+static scan_t scan_select()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return scan_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return scan_sse2;
+    return scan_scalar;
+}
+#else
+static scan_t scan_select()
+{
+    return scan_scalar;
+}
+#endif
+
+static scan_t scan_func = scan_select();
+
+int WireFormat::put_varint(unsigned char *out, unsigned int val)
+{
+    int n = 0;
+
+    while (val >= 0x80){
+        out[n++] = (unsigned char)(val | 0x80);
+        val >>= 7;
+    }
+    out[n++] = (unsigned char)val;
+    return n;
+}
+
+//return bytes used, 0 if incomplete, -1 if longer than 5 bytes
+int WireFormat::get_varint(const unsigned char *in, int len, unsigned int *val)
+{
+    unsigned int v = 0;
+    int i;
+
+    for (i=0; i<len && i<5; i++){
+        v |= (unsigned int)(in[i] & 0x7f) << (7*i);
+        if (!(in[i] & 0x80)){
+            *val = v;
+            return i + 1;
+        }
+    }
+    return i < 5 ? 0 : -1;
+}
+
+unsigned char WireFormat::head_check(const unsigned char *buf, int len)
+{
+    unsigned char c = 0x5a;
+    int i;
+
+    for (i=0; i<len; i++)
+        c = (unsigned char)(((c << 1) | (c >> 7)) ^ buf[i]);
+    return c;
+}
+
+int WireFormat::agree_version(const char *data, int len)
+{
+    int ver;
+
+    if (len < 1 || (unsigned char)data[0] < 1)
+        return 0;
+    ver = (unsigned char)data[0];
+    return ver < FRAME_VERSION ? ver : FRAME_VERSION;
+}
+
+int WireFormat::encode_head(unsigned char *out, int kind, int flags, unsigned int len, unsigned int chksum,
+                            const unsigned char *opts, int optlen)
+{
+    int n;
+
+    if (optlen > FRAME_MAX_OPTS)
+        optlen = 0;
+    if (optlen > 0)
+        flags |= FF_OPTS;
+    else
+        flags &= ~FF_OPTS;
+    n = 0;
+    out[n++] = FRAME_MAGIC;
+    out[n++] = (unsigned char)((FRAME_VERSION << 4) | kind);
+    out[n++] = (unsigned char)flags;
+    n += put_varint(out+n, len);
+    if (optlen > 0){
+        n += put_varint(out+n, optlen);
+        memcpy(out+n, opts, optlen);
+        n += optlen;
+    }
+    out[n] = head_check(out, n);
+    n++;
+    if (flags & FF_CRC){
+        out[n++] = (unsigned char)chksum;
+        out[n++] = (unsigned char)(chksum >> 8);
+        out[n++] = (unsigned char)(chksum >> 16);
+        out[n++] = (unsigned char)(chksum >> 24);
+    }
+    return n;
+}
+
+int WireFormat::encode_head_v1(unsigned char *out, const unsigned char *sign, unsigned int len,
+                               unsigned int flag, unsigned int chksum)
+{
+    PBH pbh = (PBH)out;
+
+    memcpy(pbh->sign, sign, 8);
+    pbh->blen = len;
+    pbh->flag = flag;
+    pbh->chksum = chksum;
+    return sizeof(BH);
+}
+
+int WireFormat::decode(const unsigned char *buf, int len, const unsigned char *sign, unsigned int maxlen, PFI fi)
+{
+    const BH *pbh;
+    unsigned int val;
+    int n, ret;
+
+    if (len <= 0)
+        return 0;
+
+    if (buf[0] == FRAME_MAGIC){
+        if (len < 3)
+            return 0;
+        if ((buf[1] >> 4) != FRAME_VERSION || (buf[1] & 0x0f) > FK_CONTROL)
+            return -1;
+        fi->version = FRAME_VERSION;
+        fi->kind = buf[1] & 0x0f;
+        fi->flags = buf[2];
+        n = 3;
+        ret = get_varint(buf+n, len-n, &fi->len);
+        if (ret <= 0)
+            return ret;
+        n += ret;
+        if (fi->len > maxlen)
+            return -1;
+        fi->opts = NULL;
+        fi->optlen = 0;
+        if (fi->flags & FF_OPTS){
+            ret = get_varint(buf+n, len-n, &val);
+            if (ret <= 0)
+                return ret;
+            if (val > FRAME_MAX_OPTS)
+                return -1;
+            n += ret;
+            if (len < n + (int)val)
+                return 0;
+            fi->opts = buf + n;
+            fi->optlen = val;
+            n += val;
+        }
+        if (len <= n)
+            return 0;
+        if (buf[n] != head_check(buf, n))
+            return -1;
+        n++;
+        if (fi->flags & FF_CRC){
+            if (len < n + 4)
+                return 0;
+            fi->chksum = buf[n] | (buf[n+1] << 8) | (buf[n+2] << 16) | ((unsigned int)buf[n+3] << 24);
+            n += 4;
+        }
+        fi->hdrlen = n;
+        if (len < n + (int)fi->len)
+            return 0;
+        return n + fi->len;
+    }
+
+    if (buf[0] == sign[0]){
+        if (len < (int)sizeof(BH))
+            return memcmp(buf, sign, len < 8 ? len : 8) == 0 ? 0 : -1;
+        pbh = (const BH *)buf;
+        if (memcmp(pbh->sign, sign, 8) != 0 || pbh->blen > maxlen || (pbh->flag & ~BH_FLAG_CONTROL))
+            return -1;
+        fi->version = 1;
+        fi->kind = (pbh->flag & BH_FLAG_CONTROL) ? FK_CONTROL : FK_DATA;
+        fi->flags = fi->kind == FK_DATA ? FF_CRC | FF_CRYPT : FF_CRC;
+        fi->len = pbh->blen;
+        fi->chksum = pbh->chksum;
+        fi->hdrlen = sizeof(BH);
+        fi->opts = NULL;
+        fi->optlen = 0;
+        if (len < (int)(sizeof(BH) + pbh->blen))
+            return 0;
+        return sizeof(BH) + pbh->blen;
+    }
+
+    if (buf[0] == (unsigned char)HEARTBEAT_V1[0]){
+        if (memcmp(buf, HEARTBEAT_V1, len < HEARTBEAT_V1_LEN ? len : HEARTBEAT_V1_LEN) != 0)
+            return -1;
+        if (len < HEARTBEAT_V1_LEN)
+            return 0;
+        fi->version = 1;
+        fi->kind = FK_HEARTBEAT;
+        fi->flags = 0;
+        fi->len = 0;
+        fi->hdrlen = HEARTBEAT_V1_LEN;
+        fi->opts = NULL;
+        fi->optlen = 0;
+        return HEARTBEAT_V1_LEN;
+    }
+    return -1;
+}
+
+//whether buf may start a frame as far as its len bytes go, decode does the rest
+static bool scan_match(const unsigned char *buf, int len, const unsigned char *sign)
+{
+    if (buf[0] == FRAME_MAGIC)
+        return len < 2 || ((buf[1] >> 4) == FRAME_VERSION && (buf[1] & 0x0f) <= FK_CONTROL);
+    if (buf[0] == sign[0] && memcmp(buf, sign, len < 8 ? len : 8) == 0)
+        return true;
+    return memcmp(buf, HEARTBEAT_V1, len < HEARTBEAT_V1_LEN ? len : HEARTBEAT_V1_LEN) == 0;
+}
+
+//look for the first byte of a v2 magic, a v1 sign or a v1 heartbeat, then the bytes
+//after it, so payload bytes that only share the first one are not candidates
+int WireFormat::scan(const unsigned char *buf, int len, const unsigned char *sign)
+{
+    int pos;
+
+    pos = 0;
+    while (pos < len){
+        pos += scan_func(buf+pos, len-pos, FRAME_MAGIC, sign[0], (unsigned char)HEARTBEAT_V1[0]);
+        if (pos >= len || scan_match(buf+pos, len-pos, sign))
+            break;
+        pos++;
+    }
+    return pos < len ? pos : len;
+}
+
+int WireFormat::find_opt(const FRAME_INFO *fi, int type, const unsigned char **val)
+{
+    int i;
+
+    for (i=0; i+2 <= fi->optlen; i += 2 + fi->opts[i+1]){
+        if (i + 2 + fi->opts[i+1] > fi->optlen)
+            break;
+        if (fi->opts[i] == type){
+            *val = fi->opts + i + 2;
+            return fi->opts[i+1];
+        }
+    }
+    return -1;
+}
+
+int WireFormat::update_opts(unsigned char *frame, int len, const unsigned char *opts, int optlen)
+{
+    unsigned int val;
+    int n, ret;
+
+    if (len < 3 || frame[0] != FRAME_MAGIC || !(frame[2] & FF_OPTS))
+        return -1;
+    n = 3;
+    ret = get_varint(frame+n, len-n, &val);
+    if (ret <= 0)
+        return -1;
+    n += ret;
+    ret = get_varint(frame+n, len-n, &val);
+    if (ret <= 0 || (int)val != optlen || len < n + ret + optlen + 1)
+        return -1;
+    n += ret;
+    memcpy(frame+n, opts, optlen);
+    n += optlen;
+    frame[n] = head_check(frame, n);
+    return 0;
+}
+
+static void put_u64(unsigned char *out, uint64_t val)
+{
+    int i;
+
+    for (i=0; i<8; i++)
+        out[i] = (unsigned char)(val >> (8*i));
+}
+
+static uint64_t get_u64(const unsigned char *in)
+{
+    uint64_t val = 0;
+    int i;
+
+    for (i=0; i<8; i++)
+        val |= (uint64_t)in[i] << (8*i);
+    return val;
+}
+
+int WireFormat::put_trace(unsigned char *out, uint64_t sendts, uint64_t encts)
+{
+    out[0] = FO_TRACE;
+    out[1] = FO_TRACE_LEN - 2;
+    put_u64(out+2, sendts);
+    put_u64(out+10, encts);
+    return FO_TRACE_LEN;
+}
+
+int WireFormat::get_trace(const FRAME_INFO *fi, uint64_t *sendts, uint64_t *encts)
+{
+    const unsigned char *val;
+
+    if (find_opt(fi, FO_TRACE, &val) != FO_TRACE_LEN - 2)
+        return -1;
+    *sendts = get_u64(val);
+    *encts = get_u64(val+8);
+    return 0;
+}
@@ -0,0 +1,84 @@
+#ifndef WIREFORMAT_H
+#define WIREFORMAT_H
+
+#include "CmnHdr.h"
+#include <stddef.h>
+#include <stdint.h>
+
+//Wire format v2, negotiated with CT_VERSION, BLOCK_HEAD frames are v1
+//  magic(1) version<<4|kind(1) flags(1) varint len [varint optlen opts] hcs(1) [crc32(4)] payload
+//hcs is a check byte over the header before it, crc32 covers the plain payload
+#define FRAME_MAGIC 0xd7
+#define FRAME_VERSION 2
+#define FRAME_MAX_OPTS 48
+#define FRAME_MAX_HEAD 64
+
+//Frame kind
+enum FRAME_KIND{
+    FK_DATA = 0,
+    FK_HEARTBEAT,
+    FK_ACK,
+    FK_CONTROL
+};
+
+//Frame flag(v2)
+#define FF_CRC 0x1          //crc32 of the plain payload follows the header
+#define FF_OPTS 0x2         //optional fields are present
+#define FF_CRYPT 0x4        //payload is RC4 encrypted
+
+//Optional field type, each field is type(1) len(1) value
+enum FRAME_OPT{
+    FO_NONE = 0,
+    FO_SEQ,             //varint message sequence number of a multicast publisher, starts at 1
+    FO_TRACE,           //SendData entry(8) and encode done(8) stamps, little-endian ns since epoch
+    FO_DEDUP,           //empty, the payload is a chunk recipe(Dedup.h)
+    FO_RPC              //rpc head(Rpc.h) of the message, only sent once CT_RPC is agreed
+};
+
+#define FO_TRACE_LEN 18
+#define FO_RPC_MAX 16       //longest rpc head
+
+//v1 heartbeat is a bare 16 bytes string
+#define HEARTBEAT_V1 "85j#$^dfgl@s23\0"
+#define HEARTBEAT_V1_LEN 16
+
+typedef struct FRAME_INFO{
+    int version;
+    int kind;
+    int flags;
+    unsigned int len;       //payload length
+    unsigned int chksum;    //valid with FF_CRC
+    int hdrlen;             //bytes before payload
+    const unsigned char *opts;
+    int optlen;
+}FI, *PFI;
+
+class WireFormat
+{
+public:
+    static int put_varint(unsigned char *out, unsigned int val);
+    static int get_varint(const unsigned char *in, int len, unsigned int *val);
+    //write a v2 header, return its length
+    static int encode_head(unsigned char *out, int kind, int flags, unsigned int len, unsigned int chksum,
+                           const unsigned char *opts=NULL, int optlen=0);
+    //write a v1 BLOCK_HEAD, return its length
+    static int encode_head_v1(unsigned char *out, const unsigned char *sign, unsigned int len,
+                              unsigned int flag, unsigned int chksum);
+    //return the whole frame length, 0 if more bytes are needed, -1 if buf does not start with a valid frame
+    static int decode(const unsigned char *buf, int len, const unsigned char *sign, unsigned int maxlen, PFI fi);
+    //return the option value length and set val, -1 if not present
+    static int find_opt(const FRAME_INFO *fi, int type, const unsigned char **val);
+    //replace the options of an encoded v2 header with ones of the same length, the check byte is refreshed
+    static int update_opts(unsigned char *frame, int len, const unsigned char *opts, int optlen);
+    //write a FO_TRACE field, return its length
+    static int put_trace(unsigned char *out, uint64_t sendts, uint64_t encts);
+    static int get_trace(const FRAME_INFO *fi, uint64_t *sendts, uint64_t *encts);
+    static unsigned char head_check(const unsigned char *buf, int len);
+    //version both ends speak after a CT_VERSION payload from the peer, 0 if it is bad
+    //the listener answers with it in the old format, then both switch
+    static int agree_version(const char *data, int len);
+    //offset of the first byte that may start a frame, len if there is none
+    static int scan(const unsigned char *buf, int len, const unsigned char *sign);
+};
+
+#endif // WIREFORMAT_H
@@ -0,0 +1,136 @@
+//Ping-pong over the coroutine API, many connections on a few event loops
+//  asyncping -s [-l loops] port
+//  asyncping [-l loops] [-c conns] [-n msgs] [-b bytes] host port
+#include "Async.h"
+#include <latch>
+
+static std::atomic<unsigned long> g_msgs;
+static std::atomic<unsigned long> g_failed;
+static std::atomic<uint64_t> g_rtt;
+
+static uint64_t now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: asyncping -s [-l loops] port\n"
+                    "       asyncping [-l loops] [-c conns] [-n msgs] [-b bytes] host port\n"
+                    "  -s        echo server\n"
+                    "  -l loops  event loop threads(default 1)\n"
+                    "  -c conns  connections, each runs one ping-pong flow(default 100)\n"
+                    "  -n msgs   messages per connection(default 1000)\n"
+                    "  -b bytes  message size(default 64)\n");
+}
+
+//the connection lives and dies on its own loop
+static Task<void> echo(std::unique_ptr<AsyncConnection> conn)
+{
+    co_await conn->loop()->schedule();
+    while (auto msg = co_await conn->recv()){
+        if (co_await conn->send(msg->data(), msg->size()) < 0)
+            break;
+    }
+}
+
+static Task<void> serve(AsyncServer *server, EventLoopGroup *group)
+{
+    while (auto conn = co_await server->accept(group->next())){
+        EventLoop *loop = conn->loop();
+        loop->spawn(echo(std::move(conn)));
+    }
+}
+
+static Task<void> ping(EventLoop *loop, const char *host, int port, int count, int bytes, std::latch *done)
+{
+    std::vector<char> buf(bytes, 'a');
+    TRANSPORT_OPTS opts;
+    uint64_t t0;
+    int i;
+
+    NetCore::low_latency_options(&opts);
+    auto conn = co_await AsyncConnection::connect(loop, host, port, &opts);
+    if (!conn){
+        g_failed++;
+        done->count_down();
+        co_return;
+    }
+    for (i=0; i<count; i++){
+        t0 = now();
+        if (co_await conn->send(buf.data(), bytes) < 0)
+            break;
+        auto msg = co_await conn->recv();
+        if (!msg || (int)msg->size() != bytes)
+            break;
+        g_rtt += now() - t0;
+        g_msgs++;
+    }
+    if (i < count)
+        g_failed++;
+    conn.reset();
+    done->count_down();
+}
+
+int main(int argc, char *argv[])
+{
+    bool isserver = false;
+    int loops = 1, conns = 100, count = 1000, bytes = 64;
+    int opt, i;
+    TRANSPORT_OPTS opts;
+    uint64_t start, end;
+    double secs;
+
+    while ((opt = getopt(argc, argv, "sl:c:n:b:")) != -1){
+        switch (opt){
+        case 's': isserver = true; break;
+        case 'l': loops = atoi(optarg); break;
+        case 'c': conns = atoi(optarg); break;
+        case 'n': count = atoi(optarg); break;
+        case 'b': bytes = atoi(optarg); break;
+        default: usage(); return 1;
+        }
+    }
+    if (argc - optind != (isserver ? 1 : 2) || loops <= 0 || conns <= 0 || bytes <= 0){
+        usage();
+        return 1;
+    }
+
+    EventLoopGroup group(loops);
+    if (isserver){
+        NetCore::low_latency_options(&opts);
+        opts.backlog = 1024;
+        AsyncServer server(group.get(0), atoi(argv[optind]), NULL, &opts);
+        if (!server.isOpen()){
+            fprintf(stderr, "listen on port %s failed\n", argv[optind]);
+            return 1;
+        }
+        group.get(0)->spawn(serve(&server, &group));
+        group.start();
+        for (;;)
+            pause();
+    }
+
+    std::latch done(conns);
+    group.start();
+    start = now();
+    for (i=0; i<conns; i++){
+        EventLoop *loop = group.next();
+        loop->spawn(ping(loop, argv[optind], atoi(argv[optind+1]), count, bytes, &done));
+    }
+    done.wait();
+    end = now();
+    group.stop();
+
+    secs = (end - start) / 1e9;
+    printf("connections %d on %d loops, %d failed\n", conns, loops, (int)g_failed.load());
+    printf("messages    %lu in %.3fs\n", g_msgs.load(), secs);
+    if (g_msgs > 0){
+        printf("rate        %.0f msg/s\n", g_msgs / secs);
+        printf("rtt         %.1fus mean\n", g_rtt / 1000.0 / g_msgs);
+    }
+    return 0;
+}
@@ -0,0 +1,33 @@
+TEMPLATE = app
+CONFIG += console
+CONFIG += thread
+CONFIG += c++2a
+CONFIG -= app_bundle
+CONFIG -= qt
+
+INCLUDEPATH += ../..
+
+SOURCES += asyncping.cpp \
+    ../../Async.cpp \
+    ../../DataTransmit.cpp \
+    ../../ShmRing.cpp \
+    ../../WireFormat.cpp \
+    ../../Capture.cpp \
+    ../../Trace.cpp \
+    ../../Dedup.cpp \
+    ../../Pacing.cpp
+
+HEADERS += \
+    ../../Async.h \
+    ../../CmnHdr.h \
+    ../../DataTransmit.h \
+    ../../ShmRing.h \
+    ../../WireFormat.h \
+    ../../Capture.h \
+    ../../Trace.h \
+    ../../Dedup.h \
+    ../../Pacing.h \
+    ../../Transport.h \
+    ../../Control.h
+
+LIBS += -lrt
@@ -0,0 +1,154 @@
+//Replay a capture through DataTransmit, a capture holds the messages given to SendData
+//and the callback function, not the frames on the wire, so they are encoded again
+//  dtreplay [-s speed] [-f] [-d send|recv] [-c connid] [-t timeout] [-S] [-u] capture host port
+#include "DataTransmit.h"
+#include <vector>
+#include <algorithm>
+
+static uint64_t now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t)
+{
+    struct timespec ts;
+
+    ts.tv_sec = t / 1000000000ULL;
+    ts.tv_nsec = t % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static void report(const char *name, std::vector<uint64_t> &v)
+{
+    if (v.empty())
+        return;
+    std::sort(v.begin(), v.end());
+    printf("%-10s p50 %.1fus  p99 %.1fus  max %.1fus\n", name,
+           v[v.size()/2] / 1000.0, v[v.size()*99/100] / 1000.0, v.back() / 1000.0);
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: dtreplay [-s speed] [-f] [-d send|recv] [-c connid] [-t timeout] [-S] [-u] capture host port\n"
+                    "  -s speed   replay at speed times the recorded rate(default 1)\n"
+                    "  -f         replay as fast as possible\n"
+                    "  -d dir     direction to replay(default send)\n"
+                    "  -c connid  replay only this connection\n"
+                    "  -t timeout seconds to wait for the connection(default 10)\n"
+                    "  -S         simplify mode\n"
+                    "  -u         use udp\n");
+}
+
+int main(int argc, char *argv[])
+{
+    double speed = 1.0;
+    bool fast = false, simplify = false, udp = false;
+    int dir = CAPTURE_SEND;
+    long connid = -1;
+    int timeout = 10;
+    int opt, ret;
+    CaptureReader reader;
+    CAPTURE_REC rec;
+    DataTransmit *dt;
+    TRANSPORT_OPTS opts;
+    char *buf;
+    uint64_t first, last, start, target, t0, t1, end;
+    unsigned long msgs, bytes, skipped, failed;
+    std::vector<uint64_t> lateness, sendtime;
+
+    while ((opt = getopt(argc, argv, "s:fd:c:t:Su")) != -1){
+        switch (opt){
+        case 's': speed = atof(optarg); break;
+        case 'f': fast = true; break;
+        case 'd': dir = strcmp(optarg, "recv") == 0 ? CAPTURE_RECV : CAPTURE_SEND; break;
+        case 'c': connid = atol(optarg); break;
+        case 't': timeout = atoi(optarg); break;
+        case 'S': simplify = true; break;
+        case 'u': udp = true; break;
+        default: usage(); return 1;
+        }
+    }
+    if (argc - optind != 3 || speed <= 0 || timeout <= 0){
+        usage();
+        return 1;
+    }
+    if (reader.Open(argv[optind]) < 0){
+        fprintf(stderr, "open capture %s failed\n", argv[optind]);
+        return 1;
+    }
+
+    dt = new DataTransmit(argv[optind+1], atoi(argv[optind+2]));
+    dt->SetUseUdp(udp);
+    dt->SetSimplify(simplify);
+    dt->InitialConnection();
+    target = now() + timeout * 1000000000ULL;
+    while (!dt->GetConnectionStatus() && now() < target)
+        usleep(1000);
+    if (!dt->GetConnectionStatus()){
+        fprintf(stderr, "connect %s:%s timed out\n", argv[optind+1], argv[optind+2]);
+        dt->StopConnection();
+        delete dt;
+        return 1;
+    }
+    opts = dt->GetTransportOptions();
+    buf = (char *)malloc(opts.maxdatalen);
+
+    msgs = bytes = skipped = failed = 0;
+    first = last = 0;
+    start = now();
+    while (true){
+        ret = reader.Next(&rec, buf, opts.maxdatalen);
+        if (ret == -1)
+            break;
+        if (rec.dir != dir || (connid >= 0 && rec.connid != (unsigned long)connid))
+            continue;
+        if (ret < 0){
+            skipped++;
+            continue;
+        }
+        if (msgs == 0 && failed == 0)
+            first = rec.ts;
+
+        t0 = now();
+        if (!fast){
+            target = start + (uint64_t)((rec.ts - first) / speed);
+            if (target > t0)
+                sleep_until(target);
+            t0 = now();
+            lateness.push_back(t0 > target ? t0 - target : 0);
+        }
+        if (dt->SendData(buf, ret) < 0){
+            failed++;
+            continue;
+        }
+        t1 = now();
+        sendtime.push_back(t1 - t0);
+        msgs++;
+        bytes += ret;
+        last = rec.ts;
+    }
+    end = now();
+
+    printf("messages   %lu(%lu skipped, %lu failed)\n", msgs, skipped, failed);
+    printf("bytes      %lu\n", bytes);
+    if (msgs > 0){
+        double secs = (end - start) / 1e9;
+        printf("recorded   %.3fs\n", (last - first) / 1e9);
+        printf("replayed   %.3fs\n", secs);
+        printf("rate       %.0f msg/s  %.2f MB/s\n", msgs / secs, bytes / secs / 1048576);
+        if (secs > 0 && last > first)
+            printf("speed      %.2fx recorded\n", (last - first) / 1e9 / secs);
+    }
+    report("lateness", lateness);
+    report("SendData", sendtime);
+
+    dt->StopConnection();
+    delete dt;
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,31 @@
+TEMPLATE = app
+CONFIG += console
+CONFIG += thread
+CONFIG += c++11
+CONFIG -= app_bundle
+CONFIG -= qt
+
+INCLUDEPATH += ../..
+
+SOURCES += dtreplay.cpp \
+    ../../DataTransmit.cpp \
+    ../../ShmRing.cpp \
+    ../../WireFormat.cpp \
+    ../../Capture.cpp \
+    ../../Trace.cpp \
+    ../../Dedup.cpp \
+    ../../Pacing.cpp
+
+HEADERS += \
+    ../../CmnHdr.h \
+    ../../DataTransmit.h \
+    ../../ShmRing.h \
+    ../../WireFormat.h \
+    ../../Capture.h \
+    ../../Trace.h \
+    ../../Dedup.h \
+    ../../Pacing.h \
+    ../../Transport.h \
+    ../../Control.h
+
+LIBS += -lrt
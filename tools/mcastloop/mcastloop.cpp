@@ -0,0 +1,90 @@
+//Multicast publishers and a subscriber in one process on the loopback interface
+//  mcastloop [-p publishers] [-n msgs] [-b bytes] [-g group] [-P port]
+#include "DataTransmit.h"
+#include <vector>
+
+static std::atomic<unsigned long> g_received;
+
+static void received(char *, int)
+{
+    g_received++;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: mcastloop [-p publishers] [-n msgs] [-b bytes] [-g group] [-P port]\n"
+                    "  -p publishers  publishers sending in turn(default 3)\n"
+                    "  -n msgs        messages per publisher(default 10000)\n"
+                    "  -b bytes       message size(default 256)\n"
+                    "  -g group       multicast group(default 239.255.0.7)\n"
+                    "  -P port        group port(default 19700)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int pubs = 3, count = 10000, bytes = 256, port = 19700;
+    const char *group = "239.255.0.7";
+    std::vector<DataTransmit *> publishers;
+    unsigned long sent, recv, lost;
+    int opt, i, j, ready;
+
+    while ((opt = getopt(argc, argv, "p:n:b:g:P:")) != -1){
+        switch (opt){
+        case 'p': pubs = atoi(optarg); break;
+        case 'n': count = atoi(optarg); break;
+        case 'b': bytes = atoi(optarg); break;
+        case 'g': group = optarg; break;
+        case 'P': port = atoi(optarg); break;
+        default: usage(); return 1;
+        }
+    }
+    if (argc != optind || pubs <= 0 || count <= 0 || bytes <= 0 || bytes > MCAST_MAX_DATAGRAM - FRAME_MAX_HEAD){
+        usage();
+        return 1;
+    }
+
+    DataTransmit subscriber(port);
+    subscriber.SetMulticast(group, "127.0.0.1");
+    subscriber.SetCallbackfunction(received);
+    subscriber.InitialConnection();
+    for (i=0; i<pubs; i++){
+        publishers.push_back(new DataTransmit(group, port));
+        publishers[i]->SetMulticast(group, "127.0.0.1");
+        publishers[i]->InitialConnection();
+    }
+    for (i=0; i<5000; i++){
+        for (j=0, ready=0; j<pubs; j++)
+            ready += publishers[j]->GetConnectionStatus();
+        if (ready == pubs)
+            break;
+        usleep(1000);
+    }
+    usleep(100000);
+
+    //the publishers interleave, each one numbers its own messages
+    std::vector<char> buf(bytes, 'm');
+    sent = 0;
+    for (i=0; i<count; i++){
+        for (j=0; j<pubs; j++){
+            if (publishers[j]->SendData(buf.data(), bytes) >= 0)
+                sent++;
+        }
+        //stay below the socket buffers, a drop shows up as lost
+        if (i % 16 == 15)
+            usleep(1000);
+    }
+    for (i=0; i<1000 && g_received < sent; i++)
+        usleep(1000);
+
+    subscriber.GetMulticastStats(&recv, &lost);
+    printf("publishers %d on %s:%d\n", pubs, group, port);
+    printf("sent       %lu\n", sent);
+    printf("received   %lu\n", recv);
+    printf("lost       %lu\n", lost);
+    for (i=0; i<pubs; i++){
+        publishers[i]->StopConnection();
+        delete publishers[i];
+    }
+    subscriber.StopConnection();
+    return recv > 0 ? 0 : 1;
+}
@@ -0,0 +1,126 @@
+//Ping-pong between two DataTransmit instances of one process, over the shared memory ring and over tcp
+//  shmping [-n msgs] [-b bytes] [-p port]
+#include "DataTransmit.h"
+#include <vector>
+#include <algorithm>
+
+static DataTransmit *g_echo;
+static std::atomic<int> g_replies;
+
+static uint64_t now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void echo(char *buf, int len)
+{
+    g_echo->SendData(buf, len);
+}
+
+static void reply(char *, int)
+{
+    g_replies++;
+}
+
+static void report(const char *name, std::vector<uint64_t> &v)
+{
+    if (v.empty())
+        return;
+    std::sort(v.begin(), v.end());
+    printf("%-5s p50 %.1fus  p99 %.1fus  p99.9 %.1fus  max %.1fus\n", name, v[v.size()/2] / 1000.0,
+           v[v.size()*99/100] / 1000.0, v[v.size()*999/1000] / 1000.0, v.back() / 1000.0);
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: shmping [-n msgs] [-b bytes] [-p port]\n"
+                    "  -n msgs   round trips per transport(default 100000)\n"
+                    "  -b bytes  message size(default 64)\n"
+                    "  -p port   loopback port(default 19800)\n");
+}
+
+//one round trip at a time, the first tenth warms up and is not counted
+static int pingpong(const char *name, int port, bool ring, int count, int bytes)
+{
+    TRANSPORT_OPTS opts;
+    std::vector<uint64_t> rtt;
+    std::vector<char> buf(bytes, 'a');
+    uint64_t t0, deadline;
+    int i, expect;
+
+    NetCore::low_latency_options(&opts);
+    if (!ring)
+        opts.shmsize = 0;
+    DataTransmit server(port, "127.0.0.1");
+    DataTransmit client("127.0.0.1", port);
+    server.SetTransportOptions(&opts);
+    client.SetTransportOptions(&opts);
+    server.SetCallbackfunction(echo);
+    client.SetCallbackfunction(reply);
+    g_echo = &server;
+    g_replies = 0;
+    server.InitialConnection();
+    client.InitialConnection();
+
+    //both directions switch to the ring shortly after the link comes up
+    deadline = now() + 5000000000ULL;
+    while (now() < deadline && !(client.GetConnectionStatus() && server.GetConnectionStatus() &&
+           (!ring || (client.GetSharedMemoryStatus() && server.GetSharedMemoryStatus()))))
+        usleep(1000);
+    if (!client.GetConnectionStatus() || (ring && !client.GetSharedMemoryStatus())){
+        fprintf(stderr, "%s: %s\n", name, client.GetConnectionStatus() ? "no shared memory ring" : "not connected");
+        return -1;
+    }
+
+    rtt.reserve(count);
+    expect = 0;
+    for (i=0; i<count + count/10; i++){
+        t0 = now();
+        if (client.SendData(buf.data(), bytes) < 0)
+            break;
+        expect++;
+        deadline = t0 + 1000000000ULL;
+        while (g_replies < expect && now() < deadline)
+            ;
+        if (g_replies < expect)
+            break;
+        if (i >= count/10)
+            rtt.push_back(now() - t0);
+    }
+    client.StopConnection();
+    server.StopConnection();
+    if ((int)rtt.size() < count){
+        fprintf(stderr, "%s: lost a reply after %d round trips\n", name, (int)rtt.size());
+        return -1;
+    }
+    report(name, rtt);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int count = 100000, bytes = 64, port = 19800;
+    int opt, ret;
+
+    while ((opt = getopt(argc, argv, "n:b:p:")) != -1){
+        switch (opt){
+        case 'n': count = atoi(optarg); break;
+        case 'b': bytes = atoi(optarg); break;
+        case 'p': port = atoi(optarg); break;
+        default: usage(); return 1;
+        }
+    }
+    if (argc != optind || count <= 0 || bytes <= 0){
+        usage();
+        return 1;
+    }
+
+    printf("%d round trips of %d bytes\n", count, bytes);
+    ret = pingpong("ring", port, true, count, bytes);
+    if (pingpong("tcp", port + 1, false, count, bytes) < 0)
+        ret = -1;
+    return ret < 0 ? 1 : 0;
+}